@@ -8,4 +8,8 @@ $(package): src/main.o src/library.o src/pv.o @NLSOBJ@
 $(package)-static: src/main.o src/library.o src/pv.o @NLSOBJ@
 	$(CC) $(LINKFLAGS) $(CFLAGS) -static -o $@ src/main.o src/library.o src/pv.o @NLSOBJ@ $(LIBS)
 
+lib$(package).a: src/library.o src/pv.o @NLSOBJ@
+	rm -f $@
+	ar rcs $@ src/library.o src/pv.o @NLSOBJ@
+
 # EOF
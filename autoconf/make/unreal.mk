@@ -151,8 +151,18 @@ install: all doc
 	  "$(DESTDIR)$(bindir)"
 	$(srcdir)/autoconf/scripts/mkinstalldirs \
 	  "$(DESTDIR)$(mandir)/man1"
+	$(srcdir)/autoconf/scripts/mkinstalldirs \
+	  "$(DESTDIR)$(libdir)"
+	$(srcdir)/autoconf/scripts/mkinstalldirs \
+	  "$(DESTDIR)$(includedir)/$(package)"
 	$(INSTALL) -m 755 $(package) \
 	                  "$(DESTDIR)$(bindir)/$(package)"
+	$(INSTALL_DATA) lib$(package).a \
+	                  "$(DESTDIR)$(libdir)/lib$(package).a"
+	$(INSTALL_DATA) $(srcdir)/src/include/pv.h \
+	                  "$(DESTDIR)$(includedir)/$(package)/pv.h"
+	$(INSTALL_DATA) $(srcdir)/src/include/options.h \
+	                  "$(DESTDIR)$(includedir)/$(package)/options.h"
 	$(INSTALL) -m 644 doc/quickref.1 \
 	                  "$(DESTDIR)$(mandir)/man1/$(package).1"
 	-$(DO_GZIP) "$(DESTDIR)$(mandir)/man1/$(package).1"
@@ -174,6 +184,9 @@ install: all doc
 
 uninstall:
 	-$(UNINSTALL) "$(DESTDIR)$(bindir)/$(package)"
+	-$(UNINSTALL) "$(DESTDIR)$(libdir)/lib$(package).a"
+	-$(UNINSTALL) "$(DESTDIR)$(includedir)/$(package)/pv.h"
+	-$(UNINSTALL) "$(DESTDIR)$(includedir)/$(package)/options.h"
 	-$(UNINSTALL) "$(DESTDIR)$(mandir)/man1/$(package).1"
 	-$(UNINSTALL) "$(DESTDIR)$(mandir)/man1/$(package).1.gz"
 	-if test -n "$(CATALOGS)"; then \
@@ -7,6 +7,8 @@ srcdir = @srcdir@
 prefix = @prefix@
 exec_prefix = @exec_prefix@
 bindir = @bindir@
+libdir = @libdir@
+includedir = @includedir@
 infodir = @infodir@
 mandir = @mandir@
 etcdir = @prefix@/etc
@@ -43,6 +45,6 @@ CFLAGS = @CFLAGS@
 CPPFLAGS = @CPPFLAGS@ -I$(srcdir)/src/include -Isrc/include $(DEFS)
 LIBS = @LIBS@
 
-alltarg = @PACKAGE@
+alltarg = @PACKAGE@ lib@PACKAGE@.a
 
 # EOF
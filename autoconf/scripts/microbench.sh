@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Time pv copying a file into a pipe in small blocks, to show the overhead
+# of each trip around the transfer loop, in each of the four transfer
+# variants: bytes or lines, with or without a rate limit. The rate limit
+# is set far above what the machine can manage so that it never actually
+# slows anything down.
+#
+# Usage: pv=./pv microbench.sh [MEGABYTES [BLOCKSIZE]]
+#
+
+test_input=`mktemp /tmp/pvbench1XXXXXX`
+
+trap "rm -f ${test_input}" 0
+
+size=${1:-256}
+block=${2:-4096}
+pv=${pv:-./pv}
+test -x ${pv} || pv=pv
+
+yes "0123456789abcdef0123456789abcdef0123456789abcdef012345678" \
+| head -c ${size}m > ${test_input}
+
+TIMEFORMAT="%R"
+
+echo -e "Mode\tLimit\tSeconds"
+
+for mode in bytes lines; do
+	for limit in none high; do
+		modeparm=""
+		test ${mode} = lines && modeparm="-l"
+		limitparm=""
+		test ${limit} = high && limitparm="-L 100g"
+		elapsed=$( { time ${pv} -q ${modeparm} ${limitparm} \
+		  -B ${block} ${test_input} | cat > /dev/null ; } 2>&1 )
+		echo -e "${mode}\t${limit}\t${elapsed}"
+	done
+done
+
+# EOF
@@ -22,25 +22,49 @@ struct opts_s {           /* structure describing run-time options */
 	unsigned char eta;             /* ETA flag */
 	unsigned char rate;            /* rate counter flag */
 	unsigned char average_rate;    /* average rate counter flag */
+	unsigned int rate_window;      /* updates to average rate/ETA over */
+	unsigned char ewma;            /* weight rate window exponentially */
+	unsigned char eta_range;       /* show how far out the ETA may be */
 	unsigned char bytes;           /* bytes transferred flag */
 	unsigned char force;           /* force-if-not-terminal flag */
 	unsigned char cursor;          /* whether to use cursor positioning */
 	unsigned char numeric;         /* numeric output only */
 	unsigned char wait;            /* wait for transfer before display */
 	unsigned char linemode;        /* count lines instead of bytes */
+	unsigned char delimiter;       /* end of line byte, usually '\n' */
 	unsigned char no_op;           /* do nothing other than pipe data */
 	unsigned long long rate_limit; /* rate limit, in bytes per second */
+	char *rate_schedule;           /* -L schedule by time of day, if any */
+	double ramp;                   /* seconds to ramp up to rate_limit */
+	char *finish_by;               /* time to pace the transfer to end by */
+	unsigned char strict_deadline; /* exit status 128 if it can't be met */
+	unsigned long long line_rate_limit;/* rate limit, in lines per second */
+	unsigned long long burst;      /* most to send at once when limited */
+	char *rate_group;              /* name of rate group to join, if any */
+	unsigned long long group_limit;/* rate limit for the whole group */
+	unsigned int adaptive_limit;   /* % I/O pressure to keep below */
 	unsigned long long buffer_size;/* buffer size, in bytes (0=default) */
+	unsigned int high_water;       /* % buffer fill to start writing at */
+	unsigned int low_water;        /* % buffer fill to stop writing at */
+	unsigned char lock_buffer;     /* mlock() the transfer buffer */
+	unsigned char skip_errors;     /* skip read errors on seekable input */
+	char *error_map;               /* file to log skipped ranges to */
+	unsigned long long write_behind;/* bytes per output writeback window */
+	unsigned char sync_at_end;     /* fdatasync() output before exiting */
+	unsigned char multi;           /* args are input:output[:name] */
+	char *output;                  /* file to write to, NULL for stdout */
+	unsigned char release_stdout;  /* swap stdout for /dev/null at end */
 	unsigned int remote;           /* PID of pv to update settings of */
-	unsigned long long size;       /* total size of data */
+	unsigned long long size;       /* total size of data, if given */
+	unsigned char estimate;        /* estimate line count by sampling */
+	unsigned char no_line_cache;   /* don't use the line count cache */
+	unsigned char both;            /* count bytes as well as lines */
 	double interval;               /* interval between updates */
 	unsigned int width;            /* screen width */
 	unsigned int height;           /* screen height */
 	char *name;                    /* process name, if any */
 	int argc;                      /* number of non-option arguments */
 	char **argv;                   /* array of non-option arguments */
-	char *current_file;            /* current file being read */
-	unsigned char exit_status;     /* exit status to give (0=OK) */
 };
 
 extern opts_t opts_parse(int, char **);
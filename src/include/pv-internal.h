@@ -0,0 +1,219 @@
+/*
+ * Internal state structure for a single transfer, shared between the
+ * modules in src/pv/ but opaque to everything else.
+ *
+ * Since this pulls in system headers, any feature test macros such as
+ * _GNU_SOURCE must be defined before it is included.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#ifndef _PV_INTERNAL_H
+#define _PV_INTERNAL_H 1
+
+#include "options.h"
+#include "pv.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Data transfer state, used by transfer.c.
+ */
+struct pv_transfer_state {
+	unsigned long long bufsize;	 /* buffer size to use */
+	unsigned char *buf;		 /* transfer buffer */
+	unsigned long long buf_alloced;	 /* allocated size of buffer */
+	unsigned long in_buffer;	 /* bytes in the buffer */
+	unsigned long bytes_written;	 /* bytes written from the buffer */
+	int splice_failed_fd;		 /* fd that splice() failed on */
+	int nowait;			 /* set to poll rather than wait */
+	int prebuffering;		 /* set if filling to high water mark */
+	unsigned long long bad_sectors;	 /* unreadable blocks skipped so far */
+	FILE *errmap;			 /* error map file, if any */
+	char *bad_file;			 /* file of current bad range */
+	unsigned long long bad_start;	 /* start of current bad range */
+	unsigned long long bad_len;	 /* length of current bad range */
+	int wb_active;			 /* write-behind: -1 unknown, 0/1 */
+	unsigned long long wb_origin;	 /* offset where writing began */
+	unsigned long long wb_start;	 /* start of unsynced output */
+	unsigned long long wb_offset;	 /* current output offset */
+};
+
+/*
+ * Recent rates, used by display.c to smooth the rate and ETA shown.
+ */
+struct pv_rate_window {
+	long double *samples;		 /* ring of recent rates, or NULL */
+	int count;			 /* number of samples taken, up to N */
+	int next;			 /* where the next sample goes */
+	int unwindowed;			 /* set to use a moving average */
+	long double mean;		 /* mean of the samples */
+	long double var;		 /* variance of the samples */
+};
+
+/*
+ * Display state, used by display.c.
+ */
+struct pv_display_state {
+	int buffered;			 /* set to keep lines, not write them */
+	char *line;			 /* last line kept, if buffered */
+	int changed;			 /* set if "line" has changed */
+	long percentage;
+	long double prev_elapsed_sec;
+	long double prev_rate;
+	long double prev_trans;
+	long double prev_byte_rate;	 /* byte rate, if counting both */
+	long long prev_bytes;		 /* bytes at last rate calculation */
+	struct pv_rate_window window;	 /* recent rates, with --rate-window */
+	struct pv_rate_window byte_window;/* recent byte rates, if both */
+	char *outbuffer;
+	long outbufsize;
+	long outlen;			 /* length of line in outbuffer */
+	char *drawn;			 /* copy of last line drawn */
+	long drawnlen;			 /* its length, or -1 if none */
+	void *thread;			 /* display thread, see display.c */
+	int unthreaded;			 /* set if the thread can't start */
+};
+
+/*
+ * Cursor positioning state, used by cursor.c.
+ */
+struct pv_cursor_state {
+	int shmid;			 /* ID of our shared memory segment */
+	int pvcount;			 /* number of `pv' processes in total */
+	int pvmax;			 /* highest number of `pv's seen */
+	int *y_top;			 /* Y coord of topmost `pv' */
+	int y_lastread;			 /* last value of y_top seen */
+	int y_offset;			 /* our Y offset from the top */
+	int needreinit;			 /* set if cursor pos needs reinit */
+	int reinit_seen;		 /* reinit requests seen so far */
+	int noipc;			 /* set if we can't use IPC */
+	int uselockfile;		 /* set if we used a lockfile */
+	int lock_fd;			 /* fd of lockfile, -1 if none open */
+	int y_start;			 /* our initial Y coordinate */
+};
+
+/*
+ * Rate group state, used by group.c.
+ */
+struct pv_group_state {
+	int shmid;			 /* ID of the group's shared memory */
+	int lock_fd;			 /* fd of the group's lockfile, or -1 */
+	void *bucket;			 /* shared token bucket, or NULL */
+	unsigned long long reserved;	 /* bytes reserved but not yet sent */
+	long long reserved_at;		 /* nsec time reservation starts */
+	long long reserved_end;		 /* nsec time reservation ends */
+};
+
+/*
+ * Adaptive rate limit state, used by adaptive.c.
+ */
+struct pv_adaptive_state {
+	int psi_fd;			 /* fd of I/O pressure file, or -1 */
+	unsigned long long psi_total;	 /* usec stalled at last check */
+	long pipe_size;			 /* capacity of output pipe, or 0 */
+	long long checked;		 /* nsec time of last check, 0 if off */
+	unsigned long long done;	 /* bytes written at that point */
+	long double rate;		 /* current limit, 0 for none */
+	long double peak;		 /* fastest rate seen */
+};
+
+/*
+ * Main loop state, used by loop.c.
+ */
+struct pv_loop_state {
+	long long total_written;	 /* bytes (or lines) written */
+	long long since_last;		 /* bytes (or lines) since update */
+	unsigned long long bytes_total;	 /* bytes written, in line mode */
+	unsigned long long file_bytes;	 /* bytes_total at start of file */
+	long long file_lines;		 /* total_written at start of file */
+	long double rate;		 /* current -L rate, after any ramp */
+	long long rate_start;		 /* nsec time the ramp started */
+	long long schedule_next;	 /* nsec time to check schedule again */
+	long long deadline;		 /* nsec time to finish by, or 0 */
+	long long deadline_checked;	 /* nsec time deadline last checked */
+	unsigned long long deadline_done;/* bytes written at that point */
+	long double deadline_rate;	 /* rate needed to meet deadline */
+	long double peak_rate;		 /* fastest rate seen, for deadline */
+	int deadline_missed;		 /* set once deadline can't be met */
+	long double tokens;		 /* bytes allowed by rate limit */
+	long double line_tokens;	 /* lines allowed by line rate limit */
+	long long bucket_time;		 /* nsec time of last token refill */
+	int eof_in;			 /* set at end of input */
+	int eof_out;			 /* set at end of output */
+	int final_update;		 /* set once the final update is done */
+	int limited;			 /* set if "transfer" is rate limited */
+	int paced;			 /* set if kernel paces the output */
+	long double paced_rate;		 /* rate last given to the kernel */
+	pv_transfer_fn transfer;	 /* transfer function variant in use */
+	long long start_time;		 /* nsec time the transfer started */
+	long long next_update;		 /* nsec time of next display update */
+	long long toffset_start;	 /* pv_sig_toffset at start_time */
+	unsigned long long buffer_size;	 /* last opts->buffer_size applied */
+	unsigned long long size;	 /* last opts->size applied */
+	int fd;				 /* current input file descriptor */
+	int filenum;			 /* index of current input file */
+};
+
+/*
+ * Everything about a single transfer.
+ */
+struct pv_state_s {
+	opts_t opts;			 /* options for this transfer */
+	int output_fd;			 /* file descriptor to write to */
+	unsigned long long size;	 /* total size of data, 0 if unknown */
+	unsigned long long size_bytes;	 /* total size in bytes, in line mode */
+	unsigned long long estimate_bytes; /* bytes in input, if estimated */
+	unsigned long long sample_bytes; /* bytes sampled for the estimate */
+	unsigned long long sample_lines; /* lines found in those samples */
+	unsigned char count_later;	 /* count lines during the transfer */
+	char *current_file;		 /* current file being read */
+	unsigned char exit_status;	 /* exit status to give (0=OK) */
+	struct pv_transfer_state transfer;
+	struct pv_display_state display;
+	struct pv_cursor_state cursor;
+	struct pv_group_state group;
+	struct pv_adaptive_state adaptive;
+	struct pv_loop_state loop;
+	void *count;			 /* background line count, see file.c */
+};
+
+void pv_transfer_free(pv_state_t);
+void pv_display_free(pv_state_t);
+void pv_display_stop(pv_state_t);
+int pv_loop_fds(pv_state_t, fd_set *, fd_set *, struct timeval *);
+unsigned long long pv_transfer_records(pv_state_t, unsigned long long,
+				       int);
+void pv_crs_needreinit(void);
+void pv_count_start(pv_state_t);
+void pv_count_poll(pv_state_t, int);
+int pv_linecache_get(opts_t, int, unsigned long long *);
+void pv_linecache_put(opts_t, int, unsigned long long);
+long long pv_now_nsec(void);
+long long pv_now_coarse_nsec(void);
+void pv_sleep_until(long long, long long);
+unsigned long long pv_schedule_rate(const char *, time_t, time_t *);
+int pv_deadline_parse(const char *, time_t, time_t *);
+int pv_group_init(pv_state_t);
+long long pv_group_wait(pv_state_t, long long, unsigned long long);
+unsigned long long pv_group_allow(pv_state_t, long long, unsigned long long,
+				  unsigned long long);
+void pv_group_used(pv_state_t, unsigned long long);
+void pv_group_fini(pv_state_t);
+void pv_adaptive_init(pv_state_t, long long);
+void pv_adaptive_update(pv_state_t, long long);
+void pv_adaptive_fini(pv_state_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PV_INTERNAL_H */
+
+/* EOF */
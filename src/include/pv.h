@@ -16,26 +16,49 @@ struct opts_s;
 typedef struct opts_s *opts_t;
 #endif
 
+/*
+ * The state of a single transfer - its buffer, display, cursor position,
+ * and main loop timing - is held in an opaque structure, so that more than
+ * one transfer can be run by the same process.
+ */
+struct pv_state_s;
+typedef struct pv_state_s *pv_state_t;
+
 double pv_getnum_d(char *);
 int pv_getnum_i(char *);
 long long pv_getnum_ll(char *);
 int pv_getnum_check(char *, int);
+int pv_getbyte(char *);
+int pv_schedule_check(const char *);
+int pv_deadline_check(const char *);
+
+unsigned long pv_memcount(const void *, unsigned long, int);
+void *pv_memrchr(const void *, int, unsigned long);
 
 void pv_screensize(opts_t);
-void pv_calc_total_size(opts_t);
+void pv_calc_total_size(pv_state_t);
+
+typedef long (*pv_transfer_fn)(pv_state_t, int, int *, int *,
+			       unsigned long long, long *);
+
+pv_state_t pv_state_alloc(opts_t);
+void pv_state_free(pv_state_t);
 
 int pv_main_loop(opts_t);
-void pv_display(opts_t, long double, long long, long long);
-long pv_transfer(opts_t, int, int *, int *, unsigned long long, long *);
-void pv_set_buffer_size(unsigned long long, int);
-int pv_next_file(opts_t, int, int);
-
-void pv_crs_fini(opts_t);
-void pv_crs_init(opts_t);
-void pv_crs_update(opts_t, char *);
-#ifdef HAVE_IPC
-void pv_crs_needreinit(void);
-#endif
+int pv_multi_main_loop(opts_t);
+int pv_loop_init(pv_state_t);
+int pv_loop_step(pv_state_t);
+int pv_loop_fini(pv_state_t);
+
+void pv_display(pv_state_t, long double, long long, long long);
+long pv_transfer(pv_state_t, int, int *, int *, unsigned long long, long *);
+pv_transfer_fn pv_transfer_select(pv_state_t);
+void pv_set_buffer_size(pv_state_t, unsigned long long, int);
+int pv_next_file(pv_state_t, int, int, int);
+
+void pv_crs_fini(pv_state_t);
+void pv_crs_init(pv_state_t);
+void pv_crs_update(pv_state_t, char *);
 
 void pv_sig_allowpause(void);
 void pv_sig_checkbg(void);
@@ -15,6 +15,10 @@
 
 #define N_(String) (String)
 
+/*
+ * An entry whose "optshort" is empty is a long-only option, unless its
+ * "optlong" is also NULL, in which case it is a blank separator line.
+ */
 struct optdesc_s {
 	char *optshort;
 	char *optlong;
@@ -39,6 +43,12 @@ void display_help(void)
 		 N_("show data transfer rate counter")},
 		{"-a", "--average-rate", 0,
 		 N_("show data transfer average rate counter")},
+		{"", "--rate-window", N_("N"),
+		 N_("base the average rate and ETA on the last N updates")},
+		{"", "--ewma", 0,
+		 N_("weight recent updates more in --rate-window")},
+		{"", "--eta-range", 0,
+		 N_("show how far out the ETA may be")},
 		{"-b", "--bytes", 0,
 		 N_("show number of bytes transferred")},
 		{"-f", "--force", 0,
@@ -55,6 +65,16 @@ void display_help(void)
 		 N_("set estimated data size to SIZE bytes")},
 		{"-l", "--line-mode", 0,
 		 N_("count lines instead of bytes")},
+		{"", "--both", 0,
+		 N_("count both bytes and lines")},
+		{"-0", "--null", 0,
+		 N_("count NUL-terminated records instead of bytes")},
+		{"", "--delimiter", N_("BYTE"),
+		 N_("count records ending in BYTE instead of bytes")},
+		{"", "--estimate-lines", 0,
+		 N_("with -l, estimate line count from samples of input")},
+		{"", "--no-line-cache", 0,
+		 N_("do not remember line counts of large input files")},
 		{"-i", "--interval", N_("SEC"),
 		 N_("update every SEC seconds")},
 		{"-w", "--width", N_("WIDTH"),
@@ -66,10 +86,42 @@ void display_help(void)
 		{"", 0, 0, 0},
 		{"-L", "--rate-limit", N_("RATE"),
 		 N_("limit transfer to RATE bytes per second")},
+		{"", "--ramp", N_("SEC"),
+		 N_("with -L, build up to the limit over SEC seconds")},
+		{"", "--finish-by", N_("TIME"),
+		 N_("go only as fast as needed to finish by TIME")},
+		{"", "--strict-deadline", 0,
+		 N_("with --finish-by, fail if TIME can't be met")},
+		{"", "--adaptive-limit", N_("PCT"),
+		 N_("slow down when I/O pressure is above PCT%")},
+		{"", "--line-rate-limit", N_("RATE"),
+		 N_("limit transfer to RATE lines per second")},
+		{"", "--burst", N_("SIZE"),
+		 N_("let -L send up to SIZE bytes (or lines) at once")},
+		{"", "--rate-group", N_("NAME"),
+		 N_("share a rate limit with other pvs in group NAME")},
+		{"", "--group-limit", N_("RATE"),
+		 N_("limit the whole rate group to RATE bytes per second")},
 		{"-B", "--buffer-size", N_("BYTES"),
 		 N_("use a buffer size of BYTES")},
 		{"-R", "--remote", N_("PID"),
 		 N_("update settings of process PID")},
+		{"", "--high-water", N_("PERCENT"),
+		 N_("hold back output until the buffer is PERCENT full")},
+		{"", "--low-water", N_("PERCENT"),
+		 N_("refill the buffer when it drains to PERCENT full")},
+		{"", "--lock-buffer", 0,
+		 N_("lock the transfer buffer into memory")},
+		{"-E", "--skip-errors", 0,
+		 N_("skip read errors in input")},
+		{"", "--error-map", N_("FILE"),
+		 N_("with -E, log skipped ranges to FILE")},
+		{"", "--write-behind", N_("BYTES"),
+		 N_("flush output file to disk every BYTES")},
+		{"", "--sync-at-end", 0,
+		 N_("flush output to disk before finishing")},
+		{"", "--multi", 0,
+		 N_("treat each FILE as INPUT:OUTPUT[:NAME] and run all")},
 		{"", 0, 0, 0},
 		{"-h", "--help", 0,
 		 N_("show this help and exit")},
@@ -92,6 +144,8 @@ void display_help(void)
 		char *param;
 
 		width = 2 + strlen(optlist[i].optshort);	/* RATS: ignore */
+		if (optlist[i].optshort[0] == 0)
+			width += 2;
 #ifdef HAVE_GETOPT_LONG
 		if (optlist[i].optlong)
 			width += 2 + strlen(optlist[i].optlong);	/* RATS: ignore */
@@ -120,10 +174,15 @@ void display_help(void)
 		char *start;
 		char *end;
 
-		if (optlist[i].optshort[0] == 0) {
+		if ((optlist[i].optshort[0] == 0)
+		    && (optlist[i].optlong == NULL)) {
 			printf("\n");
 			continue;
 		}
+#ifndef HAVE_GETOPT_LONG
+		if (optlist[i].optshort[0] == 0)
+			continue;
+#endif
 
 		param = optlist[i].param;
 		if (param)
@@ -135,7 +194,8 @@ void display_help(void)
 		sprintf(optbuf, "%s%s%s%s%s",	/* RATS: ignore (checked) */
 			optlist[i].optshort,
 #ifdef HAVE_GETOPT_LONG
-			optlist[i].optlong ? ", " : "",
+			optlist[i].optlong ? (optlist[i].optshort[0] ? ", " :
+					      "    ") : "",
 			optlist[i].optlong ? optlist[i].optlong : "",
 #else
 			"", "",
@@ -13,6 +13,7 @@
 
 /* #undef MAKE_STDOUT_NONBLOCKING */
 
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -67,19 +68,21 @@ int main(int argc, char **argv)
 	}
 
 	/*
-	 * If no files were given, pretend "-" was given (stdin).
+	 * If no files were given, pretend "-" was given (stdin), unless
+	 * we're running multiple streams, in which case there is nothing
+	 * to do.
 	 */
-	if (opts->argc == 0) {
-		opts->argv[opts->argc++] = "-";
+	if ((opts->argc == 0) && (opts->multi)) {
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("no streams given"));
+		opts_free(opts);
+		return 1;
 	}
 
-	if (opts->size == 0) {
-		pv_calc_total_size(opts);
+	if (opts->argc == 0) {
+		opts->argv[opts->argc++] = "-";
 	}
 
-	if (opts->size < 1)
-		opts->eta = 0;
-
 	if ((isatty(STDERR_FILENO) == 0)
 	    && (opts->force == 0)
 	    && (opts->numeric == 0)) {
@@ -125,6 +128,16 @@ int main(int argc, char **argv)
 	if (opts->interval > 600)
 		opts->interval = 600;
 
+	/*
+	 * Watermarks are percentages of the buffer; a low water mark which
+	 * is not below the high water mark (opts_parse() has already turned
+	 * away one above it) does nothing.
+	 */
+	if (opts->high_water > 100)
+		opts->high_water = 100;
+	if (opts->low_water >= opts->high_water)
+		opts->low_water = 0;
+
 #ifdef MAKE_STDOUT_NONBLOCKING
 	/*
 	 * Try and make standard output use non-blocking I/O.
@@ -147,12 +160,20 @@ int main(int argc, char **argv)
 	t.c_lflag |= TOSTOP;
 	tcsetattr(STDERR_FILENO, TCSANOW, &t);
 
-	opts->current_file = "(stdin)";
-
 	pv_sig_init();
 	remote_sig_init(opts);
 
-	retcode = pv_main_loop(opts);
+	if (opts->multi) {
+		retcode = pv_multi_main_loop(opts);
+	} else {
+		/*
+		 * Standard output is ours to give up once the transfer is
+		 * done, so that whatever reads it isn't kept waiting for the
+		 * last update to be drawn.
+		 */
+		opts->release_stdout = 1;
+		retcode = pv_main_loop(opts);
+	}
 
 	opts_free(opts);
 
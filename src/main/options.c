@@ -21,6 +21,32 @@
 void display_help(void);
 void display_version(void);
 
+/*
+ * Values returned by getopt_long() for options with no short equivalent.
+ */
+#define OPT_HIGH_WATER		256
+#define OPT_LOW_WATER		257
+#define OPT_LOCK_BUFFER		258
+#define OPT_ERROR_MAP		259
+#define OPT_WRITE_BEHIND	260
+#define OPT_SYNC_AT_END		261
+#define OPT_MULTI		262
+#define OPT_DELIMITER		263
+#define OPT_ESTIMATE_LINES	264
+#define OPT_NO_LINE_CACHE	265
+#define OPT_BOTH		266
+#define OPT_LINE_RATE_LIMIT	267
+#define OPT_BURST		268
+#define OPT_RATE_GROUP		269
+#define OPT_GROUP_LIMIT		270
+#define OPT_RAMP		271
+#define OPT_FINISH_BY		272
+#define OPT_STRICT_DEADLINE	273
+#define OPT_ADAPTIVE_LIMIT	274
+#define OPT_RATE_WINDOW		275
+#define OPT_EWMA		276
+#define OPT_ETA_RANGE		277
+
 
 /*
  * Free an opts_t object.
@@ -56,6 +82,9 @@ opts_t opts_parse(int argc, char **argv)
 		{"eta", 0, 0, 'e'},
 		{"rate", 0, 0, 'r'},
 		{"average-rate", 0, 0, 'a'},
+		{"rate-window", 1, 0, OPT_RATE_WINDOW},
+		{"ewma", 0, 0, OPT_EWMA},
+		{"eta-range", 0, 0, OPT_ETA_RANGE},
 		{"bytes", 0, 0, 'b'},
 		{"force", 0, 0, 'f'},
 		{"numeric", 0, 0, 'n'},
@@ -64,18 +93,39 @@ opts_t opts_parse(int argc, char **argv)
 		{"wait", 0, 0, 'W'},
 		{"size", 1, 0, 's'},
 		{"line-mode", 0, 0, 'l'},
+		{"null", 0, 0, '0'},
+		{"delimiter", 1, 0, OPT_DELIMITER},
+		{"estimate-lines", 0, 0, OPT_ESTIMATE_LINES},
+		{"no-line-cache", 0, 0, OPT_NO_LINE_CACHE},
+		{"both", 0, 0, OPT_BOTH},
 		{"interval", 1, 0, 'i'},
 		{"width", 1, 0, 'w'},
 		{"height", 1, 0, 'H'},
 		{"name", 1, 0, 'N'},
 		{"rate-limit", 1, 0, 'L'},
+		{"line-rate-limit", 1, 0, OPT_LINE_RATE_LIMIT},
+		{"burst", 1, 0, OPT_BURST},
+		{"rate-group", 1, 0, OPT_RATE_GROUP},
+		{"group-limit", 1, 0, OPT_GROUP_LIMIT},
+		{"ramp", 1, 0, OPT_RAMP},
+		{"finish-by", 1, 0, OPT_FINISH_BY},
+		{"strict-deadline", 0, 0, OPT_STRICT_DEADLINE},
+		{"adaptive-limit", 1, 0, OPT_ADAPTIVE_LIMIT},
 		{"buffer-size", 1, 0, 'B'},
 		{"remote", 1, 0, 'R'},
+		{"high-water", 1, 0, OPT_HIGH_WATER},
+		{"low-water", 1, 0, OPT_LOW_WATER},
+		{"lock-buffer", 0, 0, OPT_LOCK_BUFFER},
+		{"skip-errors", 0, 0, 'E'},
+		{"error-map", 1, 0, OPT_ERROR_MAP},
+		{"write-behind", 1, 0, OPT_WRITE_BEHIND},
+		{"sync-at-end", 0, 0, OPT_SYNC_AT_END},
+		{"multi", 0, 0, OPT_MULTI},
 		{0, 0, 0, 0}
 	};
 	int option_index = 0;
 #endif
-	char *short_options = "hVpterabfnqcWs:li:w:H:N:L:B:R:";
+	char *short_options = "hVpterabfnqcWs:l0i:w:H:N:L:B:R:E";
 	int c, numopts;
 	opts_t opts;
 
@@ -105,6 +155,7 @@ opts_t opts_parse(int argc, char **argv)
 	numopts = 0;
 
 	opts->interval = 1;
+	opts->delimiter = '\n';
 
 	do {
 #ifdef HAVE_GETOPT_LONG
@@ -121,10 +172,19 @@ opts_t opts_parse(int argc, char **argv)
 		 * Check that any numeric arguments are of the right type.
 		 */
 		switch (c) {
+		case 'L':
+			if ((strchr(optarg, '=') != NULL)
+			    ? pv_schedule_check(optarg)
+			    : pv_getnum_check(optarg, 0)) {
+				fprintf(stderr, "%s: -%c: %s\n", argv[0],
+					c, _("rate or schedule expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
 		case 's':
 		case 'w':
 		case 'H':
-		case 'L':
 		case 'B':
 		case 'R':
 			if (pv_getnum_check(optarg, 0)) {
@@ -134,6 +194,51 @@ opts_t opts_parse(int argc, char **argv)
 				return 0;
 			}
 			break;
+#ifdef HAVE_GETOPT_LONG
+		case OPT_HIGH_WATER:
+		case OPT_LOW_WATER:
+		case OPT_WRITE_BEHIND:
+		case OPT_LINE_RATE_LIMIT:
+		case OPT_BURST:
+		case OPT_GROUP_LIMIT:
+		case OPT_ADAPTIVE_LIMIT:
+		case OPT_RATE_WINDOW:
+			if (pv_getnum_check(optarg, 0)) {
+				fprintf(stderr, "%s: --%s: %s\n", argv[0],
+					long_options[option_index].name,
+					_("integer argument expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+		case OPT_DELIMITER:
+			if (pv_getbyte(optarg) < 0) {
+				fprintf(stderr, "%s: --%s: %s\n", argv[0],
+					long_options[option_index].name,
+					_("single byte argument expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+		case OPT_RAMP:
+			if (pv_getnum_check(optarg, 1)) {
+				fprintf(stderr, "%s: --%s: %s\n", argv[0],
+					long_options[option_index].name,
+					_("numeric argument expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+		case OPT_FINISH_BY:
+			if (pv_deadline_check(optarg)) {
+				fprintf(stderr, "%s: --%s: %s\n", argv[0],
+					long_options[option_index].name,
+					_("HH:MM[:SS] or +SECONDS expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+#endif
 		case 'i':
 			if (pv_getnum_check(optarg, 1)) {
 				fprintf(stderr, "%s: -%c: %s\n", argv[0],
@@ -207,6 +312,10 @@ opts_t opts_parse(int argc, char **argv)
 		case 'l':
 			opts->linemode = 1;
 			break;
+		case '0':
+			opts->linemode = 1;
+			opts->delimiter = 0;
+			break;
 		case 'i':
 			opts->interval = pv_getnum_d(optarg);
 			break;
@@ -220,7 +329,13 @@ opts_t opts_parse(int argc, char **argv)
 			opts->name = optarg;
 			break;
 		case 'L':
-			opts->rate_limit = pv_getnum_ll(optarg);
+			opts->rate_limit = 0;
+			opts->rate_schedule = NULL;
+			if (strchr(optarg, '=') != NULL) {
+				opts->rate_schedule = optarg;
+			} else {
+				opts->rate_limit = pv_getnum_ll(optarg);
+			}
 			break;
 		case 'B':
 			opts->buffer_size = pv_getnum_ll(optarg);
@@ -228,6 +343,79 @@ opts_t opts_parse(int argc, char **argv)
 		case 'R':
 			opts->remote = pv_getnum_i(optarg);
 			break;
+		case OPT_HIGH_WATER:
+			opts->high_water = pv_getnum_i(optarg);
+			break;
+		case OPT_LOW_WATER:
+			opts->low_water = pv_getnum_i(optarg);
+			break;
+		case OPT_LOCK_BUFFER:
+			opts->lock_buffer = 1;
+			break;
+		case 'E':
+			opts->skip_errors = 1;
+			break;
+		case OPT_ERROR_MAP:
+			opts->error_map = optarg;
+			break;
+		case OPT_WRITE_BEHIND:
+			opts->write_behind = pv_getnum_ll(optarg);
+			break;
+		case OPT_SYNC_AT_END:
+			opts->sync_at_end = 1;
+			break;
+		case OPT_MULTI:
+			opts->multi = 1;
+			break;
+		case OPT_DELIMITER:
+			opts->linemode = 1;
+			opts->delimiter = pv_getbyte(optarg);
+			break;
+		case OPT_ESTIMATE_LINES:
+			opts->linemode = 1;
+			opts->estimate = 1;
+			break;
+		case OPT_NO_LINE_CACHE:
+			opts->no_line_cache = 1;
+			break;
+		case OPT_LINE_RATE_LIMIT:
+			opts->linemode = 1;
+			opts->line_rate_limit = pv_getnum_ll(optarg);
+			break;
+		case OPT_BURST:
+			opts->burst = pv_getnum_ll(optarg);
+			break;
+		case OPT_RATE_GROUP:
+			opts->rate_group = optarg;
+			break;
+		case OPT_GROUP_LIMIT:
+			opts->group_limit = pv_getnum_ll(optarg);
+			break;
+		case OPT_RAMP:
+			opts->ramp = pv_getnum_d(optarg);
+			break;
+		case OPT_FINISH_BY:
+			opts->finish_by = optarg;
+			break;
+		case OPT_STRICT_DEADLINE:
+			opts->strict_deadline = 1;
+			break;
+		case OPT_ADAPTIVE_LIMIT:
+			opts->adaptive_limit = pv_getnum_i(optarg);
+			break;
+		case OPT_RATE_WINDOW:
+			opts->rate_window = pv_getnum_i(optarg);
+			break;
+		case OPT_EWMA:
+			opts->ewma = 1;
+			break;
+		case OPT_ETA_RANGE:
+			opts->eta_range = 1;
+			break;
+		case OPT_BOTH:
+			opts->linemode = 1;
+			opts->both = 1;
+			break;
 		default:
 #ifdef HAVE_GETOPT_LONG
 			fprintf(stderr,	    /* RATS: ignore (OK) */
@@ -257,6 +445,24 @@ opts_t opts_parse(int argc, char **argv)
 		opts->bytes = 1;
 	}
 
+	/*
+	 * --ewma and --eta-range need a rate window, so give them one of 10
+	 * updates if none was given.
+	 */
+	if (((opts->ewma) || (opts->eta_range)) && (opts->rate_window == 0))
+		opts->rate_window = 10;
+
+	/*
+	 * The buffer can't be drained down to a level above the one it has
+	 * to fill up to first.
+	 */
+	if (opts->low_water > opts->high_water) {
+		fprintf(stderr, "%s: --low-water: %s\n", argv[0],
+			_("must not be above the high water mark"));
+		opts_free(opts);
+		return 0;
+	}
+
 	/*
 	 * Store remaining command-line arguments.
 	 */
@@ -264,7 +470,6 @@ opts_t opts_parse(int argc, char **argv)
 		opts->argv[opts->argc++] = argv[optind++];
 	}
 
-	opts->exit_status = 0;
 
 	return opts;
 }
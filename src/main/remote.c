@@ -87,6 +87,12 @@ int remote_set(opts_t opts)
 	struct remote_msg msgbuf;
 	int msgid;
 
+	if (opts->rate_schedule != NULL) {
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("a rate limit schedule cannot be set remotely"));
+		return 1;
+	}
+
 	memset(&msgbuf, 0, sizeof(msgbuf));
 	msgbuf.mtype = opts->remote;
 	msgbuf.progress = opts->progress;
@@ -170,12 +176,12 @@ static void remote__sig_usr1(int s)
 	remote__opts->rate = msgbuf.rate;
 	remote__opts->average_rate = msgbuf.average_rate;
 
-	if (msgbuf.rate_limit > 0)
+	if (msgbuf.rate_limit > 0) {
 		remote__opts->rate_limit = msgbuf.rate_limit;
-	if (msgbuf.buffer_size > 0) {
-		remote__opts->buffer_size = msgbuf.buffer_size;
-		pv_set_buffer_size(msgbuf.buffer_size, 1);
+		remote__opts->rate_schedule = NULL;
 	}
+	if (msgbuf.buffer_size > 0)
+		remote__opts->buffer_size = msgbuf.buffer_size;
 	if (msgbuf.size > 0)
 		remote__opts->size = msgbuf.size;
 	if (msgbuf.interval > 0)
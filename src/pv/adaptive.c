@@ -0,0 +1,245 @@
+/*
+ * Adaptive rate limiting (--adaptive-limit), where instead of a fixed -L
+ * rate, the limit is raised and lowered according to how much pressure
+ * the system is under.
+ *
+ * The pressure is measured as the larger of the share of time tasks spent
+ * stalled on I/O since the last check, from /proc/pressure/io (Linux's
+ * pressure stall information), and, if the output is a pipe, how full the
+ * pipe is. Each update interval, if this is above the target percentage,
+ * the limit is halved; otherwise it is raised by a twentieth of the
+ * fastest rate seen, and once it is well above that, removed altogether
+ * (additive increase, multiplicative decrease).
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#define _GNU_SOURCE 1
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define PSI_IO_FILE "/proc/pressure/io"
+#define DEFAULT_PIPE_SIZE 65536
+#define ADAPTIVE_MIN_RATE 1024
+
+
+/*
+ * Put into *total the total number of microseconds that some task has
+ * been stalled on I/O, from the "some" line of PSI_IO_FILE.
+ *
+ * Returns nonzero if it could not be read.
+ */
+static int pv__adaptive_psi(struct pv_adaptive_state *a,
+			    unsigned long long *total)
+{
+	char buf[256];			 /* RATS: ignore (checked) */
+	char *ptr;
+	ssize_t got;
+
+	if (a->psi_fd < 0)
+		return 1;
+
+	got = pread(a->psi_fd, buf, sizeof(buf) - 1, 0);
+	if (got <= 0)
+		return 1;
+	buf[got] = 0;
+
+	if (strncmp(buf, "some ", 5) != 0)
+		return 1;
+	ptr = strstr(buf, "total=");
+	if ((ptr == NULL) || (ptr > strchr(buf, '\n')))
+		return 1;
+
+	*total = strtoull(ptr + 6, NULL, 10);
+
+	return 0;
+}
+
+
+/*
+ * Return how full the output pipe is, as a percentage, or -1 if the output
+ * is not a pipe or this can't be found out.
+ */
+static int pv__adaptive_pipe(pv_state_t state)
+{
+#ifdef FIONREAD
+	struct pv_adaptive_state *a = &(state->adaptive);
+	int queued;
+
+	if (a->pipe_size < 1)
+		return -1;
+
+	if (ioctl(state->output_fd, FIONREAD, &queued) != 0)
+		return -1;
+
+	if (queued >= a->pipe_size)
+		return 100;
+
+	return (int) ((100.0 * queued) / a->pipe_size);
+#else				/* !FIONREAD */
+	return -1;
+#endif				/* FIONREAD */
+}
+
+
+/*
+ * Return the current pressure as a percentage, or -1 if there is no way of
+ * measuring it, given that "elapsed" nanoseconds have passed since the
+ * last check.
+ */
+static int pv__adaptive_pressure(pv_state_t state, long long elapsed)
+{
+	struct pv_adaptive_state *a = &(state->adaptive);
+	unsigned long long total;
+	int pressure, fill;
+
+	pressure = -1;
+
+	if (pv__adaptive_psi(a, &total) == 0) {
+		if ((elapsed > 0) && (total >= a->psi_total)) {
+			pressure = (int) ((100000.0 * (total - a->psi_total))
+					  / elapsed);
+			if (pressure > 100)
+				pressure = 100;
+		}
+		a->psi_total = total;
+	}
+
+	fill = pv__adaptive_pipe(state);
+	if (fill > pressure)
+		pressure = fill;
+
+	return pressure;
+}
+
+
+/*
+ * Start adaptive rate limiting, if opts->adaptive_limit is set, at the
+ * time "now", once the output has been opened. The transfer starts with
+ * no limit, so that we can see how fast it can go.
+ */
+void pv_adaptive_init(pv_state_t state, long long now)
+{
+	struct pv_adaptive_state *a = &(state->adaptive);
+	opts_t opts = state->opts;
+	struct stat64 sb;
+
+	a->rate = 0;
+	a->peak = 0;
+	a->done = 0;
+	a->pipe_size = 0;
+	a->checked = 0;
+
+	if (opts->adaptive_limit < 1)
+		return;
+
+	if (a->psi_fd < 0)
+		a->psi_fd = open(PSI_IO_FILE, O_RDONLY);
+	if (pv__adaptive_psi(a, &(a->psi_total)) != 0) {
+		if (a->psi_fd >= 0)
+			close(a->psi_fd);
+		a->psi_fd = -1;
+	}
+
+	if ((fstat64(state->output_fd, &sb) == 0) && S_ISFIFO(sb.st_mode)) {
+		a->pipe_size = DEFAULT_PIPE_SIZE;
+#ifdef F_GETPIPE_SZ
+		a->pipe_size = fcntl(state->output_fd, F_GETPIPE_SZ);
+		if (a->pipe_size < 1)
+			a->pipe_size = DEFAULT_PIPE_SIZE;
+#endif
+		if (pv__adaptive_pipe(state) < 0)
+			a->pipe_size = 0;
+	}
+
+	if ((a->psi_fd < 0) && (a->pipe_size < 1)) {
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("warning: --adaptive-limit ignored, as there is"
+			  " no way to measure I/O pressure"));
+		return;
+	}
+
+	a->checked = now;
+}
+
+
+/*
+ * Once per update interval, measure the pressure and the rate we have
+ * managed since the last check, and adjust the adaptive rate limit to
+ * suit, as described at the top of this file.
+ */
+void pv_adaptive_update(pv_state_t state, long long now)
+{
+	struct pv_adaptive_state *a = &(state->adaptive);
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	unsigned long long done;
+	long double achieved, step;
+	long long elapsed;
+	int pressure;
+
+	if (a->checked < 1)
+		return;
+
+	elapsed = now - a->checked;
+	if (elapsed < (long long) (opts->interval * 1000000000.0))
+		return;
+
+	done = opts->linemode ? l->bytes_total
+	    : (unsigned long long) (l->total_written);
+	achieved = ((long double) (done - a->done)) * 1000000000.0 / elapsed;
+	if (achieved > a->peak)
+		a->peak = achieved;
+
+	pressure = pv__adaptive_pressure(state, elapsed);
+
+	a->checked = now;
+	a->done = done;
+
+	if (pressure < 0)
+		return;
+
+	if (pressure > (int) (opts->adaptive_limit)) {
+		if ((a->rate <= 0) || (a->rate > achieved * 2))
+			a->rate = achieved;
+		a->rate /= 2;
+		if (a->rate < ADAPTIVE_MIN_RATE)
+			a->rate = ADAPTIVE_MIN_RATE;
+	} else if (a->rate > 0) {
+		step = a->peak / 20;
+		if (step < ADAPTIVE_MIN_RATE)
+			step = ADAPTIVE_MIN_RATE;
+		a->rate += step;
+		if (a->rate > a->peak * 2)
+			a->rate = 0;
+	}
+}
+
+
+/*
+ * Stop adaptive rate limiting, closing the pressure file.
+ */
+void pv_adaptive_fini(pv_state_t state)
+{
+	struct pv_adaptive_state *a = &(state->adaptive);
+
+	if (a->psi_fd >= 0)
+		close(a->psi_fd);
+	a->psi_fd = -1;
+}
+
+/* EOF */
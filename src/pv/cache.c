@@ -0,0 +1,248 @@
+/*
+ * Functions for remembering how many lines there are in each input file,
+ * so that line mode doesn't have to count them all again next time.
+ *
+ * Counts are kept in a text file under $XDG_CACHE_HOME (or ~/.cache), one
+ * per line, keyed by device, inode, size, modification time (to the
+ * nanosecond, where the system records it) and delimiter.
+ * New entries are appended, so the last entry for a key is the one used,
+ * and the file is cut down to its newer half once it gets too big.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#define _GNU_SOURCE 1
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define LINECACHE_MIN_SIZE	16777216    /* smallest file worth caching */
+#define LINECACHE_MAX_SIZE	65536	    /* cache file size to cut down at */
+
+
+/*
+ * Return the path of the line count cache file in a newly allocated
+ * string, creating the directory it goes in if "create" is nonzero, or
+ * return NULL if there is nowhere to put it.
+ */
+static char *pv__linecache_path(int create)
+{
+	char *base;
+	char *path;
+	int xdg;
+
+	xdg = 1;
+	base = getenv("XDG_CACHE_HOME");	/* RATS: ignore */
+	if ((base == NULL) || (base[0] != '/')) {
+		xdg = 0;
+		base = getenv("HOME");	    /* RATS: ignore */
+	}
+	if ((base == NULL) || (base[0] != '/'))
+		return NULL;
+
+	path = malloc(strlen(base) + 32);	/* RATS: ignore */
+	if (path == NULL)
+		return NULL;
+
+	sprintf(path, "%s%s", base, xdg ? "" : "/.cache");
+	if (create)
+		mkdir(path, 0700);
+
+	strcat(path, "/pv");		    /* RATS: ignore */
+	if (create)
+		mkdir(path, 0700);
+
+	strcat(path, "/lines");		    /* RATS: ignore */
+
+	return path;
+}
+
+
+/*
+ * Write the cache key for the file open on "fd" into "key", which must be
+ * at least 128 bytes long.
+ *
+ * Returns nonzero if the file is not a regular file big enough to be worth
+ * caching.
+ */
+static int pv__linecache_key(opts_t opts, int fd, char *key)
+{
+	struct stat64 sb;
+	long mtime_nsec;
+
+	if (fstat64(fd, &sb) != 0)
+		return 1;
+	if ((!S_ISREG(sb.st_mode)) || (sb.st_size < LINECACHE_MIN_SIZE))
+		return 1;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	mtime_nsec = (long) (sb.st_mtim.tv_nsec);
+#else
+	mtime_nsec = 0;
+#endif
+
+	sprintf(key, "%llu %llu %llu %lld.%09ld %d ",
+		(unsigned long long) (sb.st_dev),
+		(unsigned long long) (sb.st_ino),
+		(unsigned long long) (sb.st_size),
+		(long long) (sb.st_mtime), mtime_nsec, opts->delimiter);
+
+	return 0;
+}
+
+
+/*
+ * Look up the line count of the file open on "fd" in the cache, putting
+ * it in *lines.
+ *
+ * Returns nonzero if there is no cached count for the file as it is now.
+ */
+int pv_linecache_get(opts_t opts, int fd, unsigned long long *lines)
+{
+	char key[128];
+	char entry[256];
+	size_t keylen;
+	char *path;
+	FILE *fptr;
+	int found;
+
+	if (opts->no_line_cache)
+		return 1;
+
+	if (pv__linecache_key(opts, fd, key))
+		return 1;
+	keylen = strlen(key);		    /* RATS: ignore */
+
+	path = pv__linecache_path(0);
+	if (path == NULL)
+		return 1;
+
+	fptr = fopen(path, "r");
+	free(path);
+	if (fptr == NULL)
+		return 1;
+
+	found = 0;
+	while (fgets(entry, sizeof(entry), fptr) != NULL) {
+		if (strncmp(entry, key, keylen) != 0)
+			continue;
+		*lines = strtoull(entry + keylen, NULL, 10);
+		found = 1;
+	}
+
+	fclose(fptr);
+
+	return found ? 0 : 1;
+}
+
+
+/*
+ * Cut the cache file at "path" down to roughly its newer half, by writing
+ * that to a temporary file and renaming it over the original.
+ */
+static void pv__linecache_trim(char *path)
+{
+	char *tmppath;
+	char *data;
+	char *start;
+	FILE *fptr;
+	size_t len;
+	int written, fd;
+
+	data = malloc(LINECACHE_MAX_SIZE * 2);
+	tmppath = malloc(strlen(path) + 32);	/* RATS: ignore */
+	if ((data == NULL) || (tmppath == NULL)) {
+		if (data)
+			free(data);
+		if (tmppath)
+			free(tmppath);
+		return;
+	}
+
+	len = 0;
+	fptr = fopen(path, "r");
+	if (fptr != NULL) {
+		len = fread(data, 1, LINECACHE_MAX_SIZE * 2, fptr);
+		fclose(fptr);
+	}
+
+	start = NULL;
+	if (len > 0)
+		start = memchr(data + (len / 2), '\n', len - (len / 2));
+
+	if (start != NULL) {
+		start++;
+		sprintf(tmppath, "%s.%ld", path, (long) getpid());
+		fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd >= 0) {
+			len = data + len - start;
+			written = (write(fd, start, len) == (ssize_t) len);
+			if (close(fd) != 0)
+				written = 0;
+			if (written) {
+				rename(tmppath, path);
+			} else {
+				unlink(tmppath);
+			}
+		}
+	}
+
+	free(data);
+	free(tmppath);
+}
+
+
+/*
+ * Record "lines" as the line count of the file open on "fd", unless it is
+ * already what the cache says. Failures are silently ignored, since the
+ * cache is only there to save time.
+ */
+void pv_linecache_put(opts_t opts, int fd, unsigned long long lines)
+{
+	unsigned long long cached;
+	char entry[256];
+	struct stat64 sb;
+	char *path;
+	size_t len;
+	int cachefd;
+
+	if (opts->no_line_cache)
+		return;
+
+	if ((pv_linecache_get(opts, fd, &cached) == 0) && (cached == lines))
+		return;
+
+	if (pv__linecache_key(opts, fd, entry))
+		return;
+	len = strlen(entry);		    /* RATS: ignore */
+	sprintf(entry + len, "%llu\n", lines);
+
+	path = pv__linecache_path(1);
+	if (path == NULL)
+		return;
+
+	if ((stat64(path, &sb) == 0) && (sb.st_size > LINECACHE_MAX_SIZE))
+		pv__linecache_trim(path);
+
+	cachefd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	free(path);
+	if (cachefd < 0)
+		return;
+
+	write(cachefd, entry, strlen(entry));	/* RATS: ignore */
+	close(cachefd);
+}
+
+/* EOF */
@@ -0,0 +1,88 @@
+/*
+ * Functions for reading the time and sleeping.
+ *
+ * All times are 64-bit nanosecond counts from the monotonic clock, where
+ * there is one, so that setting the system clock (by hand or by NTP)
+ * doesn't upset rates, ETAs, or rate limits. Where nothing more precise
+ * than a few milliseconds is needed, such as to see whether a display
+ * update is due, pv_now_coarse_nsec() is cheaper still.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#include "pv-internal.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+/*
+ * Return the current time in nanoseconds.
+ *
+ * This is safe to call from a signal handler.
+ */
+long long pv_now_nsec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long) (ts.tv_sec)) * 1000000000LL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long) (tv.tv_sec)) * 1000000000LL
+	    + ((long long) (tv.tv_usec)) * 1000LL;
+#endif
+}
+
+
+/*
+ * Return the current time in nanoseconds on the same clock as
+ * pv_now_nsec(), but only to within a few milliseconds, if that can be
+ * read more cheaply.
+ */
+long long pv_now_coarse_nsec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+		return ((long long) (ts.tv_sec)) * 1000000000LL + ts.tv_nsec;
+#endif
+	return pv_now_nsec();
+}
+
+
+/*
+ * Sleep until "nsec" nanoseconds after the time "from", as returned by
+ * pv_now_nsec(), or until a signal arrives.
+ */
+void pv_sleep_until(long long from, long long nsec)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(HAVE_CLOCK_NANOSLEEP) \
+    && defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+	struct timespec ts;
+
+	from += nsec;
+	ts.tv_sec = from / 1000000000LL;
+	ts.tv_nsec = from % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#else
+	struct timeval tv;
+
+	tv.tv_sec = nsec / 1000000000LL;
+	tv.tv_usec = (nsec % 1000000000LL) / 1000;
+	select(0, NULL, NULL, NULL, &tv);
+#endif
+}
+
+/* EOF */
@@ -0,0 +1,221 @@
+/*
+ * Functions for counting and finding occurrences of a byte (such as
+ * newline) in a buffer, as quickly as the CPU allows.
+ *
+ * Where the compiler supports it, versions using SSE2, AVX2 and AVX-512
+ * are built, and the fastest one the CPU we are running on can use is
+ * chosen the first time pv_memcount() is called. Otherwise, memchr() is
+ * used, which the C library will usually have optimised already.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#define _GNU_SOURCE 1			    /* for memrchr() */
+
+#include "pv.h"
+
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# if defined(HAVE_X86_DISPATCH) || defined(__SSE2__)
+#  define PV_COUNT_SSE2 1
+#  include <emmintrin.h>
+# endif
+# ifdef HAVE_X86_DISPATCH
+#  define PV_COUNT_AVX 1
+#  include <immintrin.h>
+# endif
+#endif
+
+typedef unsigned long (*pv__count_fn)(const unsigned char *, unsigned long,
+				      unsigned char);
+
+
+/*
+ * Count the occurrences of "c" in the "len" bytes at "buf" using memchr().
+ */
+static unsigned long pv__count_generic(const unsigned char *buf,
+				       unsigned long len, unsigned char c)
+{
+	const unsigned char *end = buf + len;
+	unsigned long count = 0;
+
+	while ((buf < end)
+	       && ((buf = memchr(buf, c, end - buf)) != NULL)) {
+		count++;
+		buf++;
+	}
+
+	return count;
+}
+
+
+#ifdef PV_COUNT_SSE2
+/*
+ * Count the occurrences of "c" in the "len" bytes at "buf" 16 bytes at a
+ * time. Matches are accumulated in per-byte counters, which are added up
+ * with _mm_sad_epu8() before any of them can overflow.
+ */
+__attribute__ ((target("sse2")))
+static unsigned long pv__count_sse2(const unsigned char *buf,
+				    unsigned long len, unsigned char c)
+{
+	__m128i needle, zero, acc, total;
+	unsigned long long sums[2];
+	unsigned long i, blocks;
+
+	needle = _mm_set1_epi8((char) c);
+	zero = _mm_setzero_si128();
+	total = zero;
+
+	for (i = 0; len - i >= 16;) {
+		blocks = (len - i) / 16;
+		if (blocks > 255)
+			blocks = 255;
+		acc = zero;
+		for (; blocks > 0; blocks--, i += 16) {
+			__m128i v;
+			v = _mm_loadu_si128((const __m128i *) (buf + i));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+		}
+		total = _mm_add_epi64(total, _mm_sad_epu8(acc, zero));
+	}
+
+	_mm_storeu_si128((__m128i *) sums, total);
+
+	return sums[0] + sums[1] + pv__count_generic(buf + i, len - i, c);
+}
+#endif				/* PV_COUNT_SSE2 */
+
+
+#ifdef PV_COUNT_AVX
+/*
+ * Count the occurrences of "c" in the "len" bytes at "buf" 32 bytes at a
+ * time, as with pv__count_sse2().
+ */
+__attribute__ ((target("avx2")))
+static unsigned long pv__count_avx2(const unsigned char *buf,
+				    unsigned long len, unsigned char c)
+{
+	__m256i needle, zero, acc, total;
+	unsigned long long sums[4];
+	unsigned long i, blocks;
+
+	needle = _mm256_set1_epi8((char) c);
+	zero = _mm256_setzero_si256();
+	total = zero;
+
+	for (i = 0; len - i >= 32;) {
+		blocks = (len - i) / 32;
+		if (blocks > 255)
+			blocks = 255;
+		acc = zero;
+		for (; blocks > 0; blocks--, i += 32) {
+			__m256i v;
+			v = _mm256_loadu_si256((const __m256i *) (buf + i));
+			acc =
+			    _mm256_sub_epi8(acc,
+					    _mm256_cmpeq_epi8(v, needle));
+		}
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, zero));
+	}
+
+	_mm256_storeu_si256((__m256i *) sums, total);
+
+	return sums[0] + sums[1] + sums[2] + sums[3]
+	    + pv__count_generic(buf + i, len - i, c);
+}
+
+
+/*
+ * Count the occurrences of "c" in the "len" bytes at "buf" 64 bytes at a
+ * time, by counting the bits in the comparison mask.
+ */
+__attribute__ ((target("avx512bw,popcnt")))
+static unsigned long pv__count_avx512(const unsigned char *buf,
+				      unsigned long len, unsigned char c)
+{
+	__m512i needle;
+	unsigned long count, i;
+
+	needle = _mm512_set1_epi8((char) c);
+	count = 0;
+
+	for (i = 0; len - i >= 64; i += 64) {
+		__m512i v;
+		v = _mm512_loadu_si512((const void *) (buf + i));
+		count +=
+		    __builtin_popcountll(_mm512_cmpeq_epi8_mask(v, needle));
+	}
+
+	return count + pv__count_generic(buf + i, len - i, c);
+}
+#endif				/* PV_COUNT_AVX */
+
+
+/*
+ * Return the fastest counting function this CPU can run.
+ */
+static pv__count_fn pv__count_choose(void)
+{
+#ifdef PV_COUNT_AVX
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return pv__count_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return pv__count_avx2;
+# ifndef __SSE2__
+	if (__builtin_cpu_supports("sse2"))
+		return pv__count_sse2;
+	return pv__count_generic;
+# endif
+#endif				/* PV_COUNT_AVX */
+#ifdef PV_COUNT_SSE2
+	return pv__count_sse2;
+#else
+	return pv__count_generic;
+#endif
+}
+
+
+/*
+ * Return the number of times the byte "c" occurs in the "len" bytes at
+ * "buf".
+ */
+unsigned long pv_memcount(const void *buf, unsigned long len, int c)
+{
+	static pv__count_fn count = NULL;
+
+	if (count == NULL)
+		count = pv__count_choose();
+
+	return count((const unsigned char *) buf, len, (unsigned char) c);
+}
+
+
+/*
+ * Return a pointer to the last occurrence of the byte "c" in the "len"
+ * bytes at "buf", or NULL if there is none.
+ */
+void *pv_memrchr(const void *buf, int c, unsigned long len)
+{
+#ifdef HAVE_MEMRCHR
+	return memrchr(buf, c, len);
+#else
+	const unsigned char *ptr = (const unsigned char *) buf + len;
+
+	while (ptr > (const unsigned char *) buf) {
+		ptr--;
+		if (*ptr == (unsigned char) c)
+			return (void *) ptr;
+	}
+
+	return NULL;
+#endif
+}
+
+/* EOF */
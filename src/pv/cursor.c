@@ -13,13 +13,13 @@
  * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
  */
 
-#include "options.h"
-#include "pv.h"
+#include "pv-internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -43,25 +43,20 @@
 
 
 #ifdef HAVE_IPC
-static int pv_crs__shmid = -1;		 /* ID of our shared memory segment */
-static int pv_crs__pvcount = 1;		 /* number of `pv' processes in total */
-static int pv_crs__pvmax = 0;		 /* highest number of `pv's seen */
-static int *pv_crs__y_top = 0;		 /* pointer to Y coord of topmost `pv' */
-static int pv_crs__y_lastread = 0;	 /* last value of __y_top seen */
-static int pv_crs__y_offset = 0;	 /* our Y offset from this top position */
-static int pv_crs__needreinit = 0;	 /* set if we need to reinit cursor pos */
-static int pv_crs__noipc = 0;		 /* set if we can't use IPC */
+/*
+ * Count of reinitialisation requests made by pv_crs_needreinit(), which is
+ * called from signal handlers; each cursor state compares this against its
+ * own count of requests seen to know when it needs to reinitialise.
+ */
+static volatile sig_atomic_t pv_crs__reinit_requests = 0;
 #endif				/* HAVE_IPC */
-static int pv_crs__uselockfile = 0;	 /* set if we used a lockfile */
-static int pv_crs__lock_fd = -1;	 /* fd of lockfile, -1 if none open */
-static int pv_crs__y_start = 0;		 /* our initial Y coordinate */
 
 
 /*
  * Lock the terminal on the given file descriptor by creating and locking a
  * per-euid, per-tty, lockfile in ${TMPDIR:-${TMP:-/tmp}}.
  */
-static void pv_crs__lock_lockfile(int fd)
+static void pv_crs__lock_lockfile(struct pv_cursor_state *crs, int fd)
 {
 #ifdef O_EXLOCK
 	char *ttydev;
@@ -71,12 +66,12 @@ static void pv_crs__lock_lockfile(int fd)
 #endif
 	char lockfile[MAXPATHLEN + 1];	 /* RATS: ignore */
 
-	pv_crs__uselockfile = 1;
+	crs->uselockfile = 1;
 
 	ttydev = ttyname(fd);		    /* RATS: ignore */
 	if (!ttydev) {
 #ifdef HAVE_IPC
-		pv_crs__noipc = 1;
+		crs->noipc = 1;
 #endif
 		return;
 	}
@@ -96,18 +91,18 @@ static void pv_crs__lock_lockfile(int fd)
 		MAXPATHLEN - 64, tmpdir, basename(ttydev), geteuid());
 #endif
 
-	pv_crs__lock_fd =
+	crs->lock_fd =
 	    open(lockfile, O_RDWR | O_EXLOCK | O_CREAT | O_NOFOLLOW, 0600);
 #ifdef HAVE_IPC
-	if (pv_crs__lock_fd < 0)
-		pv_crs__noipc = 1;
+	if (crs->lock_fd < 0)
+		crs->noipc = 1;
 #endif
 
 #else				/* !O_EXLOCK */
 
-	pv_crs__uselockfile = 1;
+	crs->uselockfile = 1;
 #ifdef HAVE_IPC
-	pv_crs__noipc = 1;
+	crs->noipc = 1;
 #endif
 
 #endif				/* O_EXLOCK */
@@ -118,7 +113,7 @@ static void pv_crs__lock_lockfile(int fd)
  * Lock the terminal on the given file descriptor, falling back to using a
  * lockfile if the terminal itself cannot be locked.
  */
-static void pv_crs__lock(int fd)
+static void pv_crs__lock(struct pv_cursor_state *crs, int fd)
 {
 	struct flock lock;
 
@@ -128,7 +123,7 @@ static void pv_crs__lock(int fd)
 	lock.l_len = 1;
 	while (fcntl(fd, F_SETLKW, &lock) < 0) {
 		if (errno != EINTR) {
-			pv_crs__lock_lockfile(fd);
+			pv_crs__lock_lockfile(crs, fd);
 			return;
 		}
 	}
@@ -139,14 +134,14 @@ static void pv_crs__lock(int fd)
  * Unlock the terminal on the given file descriptor.  If pv_crs__lock used
  * lockfile locking, unlock the lockfile.
  */
-static void pv_crs__unlock(int fd)
+static void pv_crs__unlock(struct pv_cursor_state *crs, int fd)
 {
 	struct flock lock;
 
-	if (pv_crs__uselockfile) {
-		if (pv_crs__lock_fd >= 0)
-			close(pv_crs__lock_fd);
-		pv_crs__lock_fd = -1;
+	if (crs->uselockfile) {
+		if (crs->lock_fd >= 0)
+			close(crs->lock_fd);
+		crs->lock_fd = -1;
 	} else {
 		lock.l_type = F_UNLCK;
 		lock.l_whence = SEEK_SET;
@@ -161,20 +156,20 @@ static void pv_crs__unlock(int fd)
 /*
  * Get the current number of processes attached to our shared memory
  * segment, i.e. find out how many `pv' processes in total are running in
- * cursor mode (including us), and store it in pv_crs__pvcount. If this is
- * larger than pv_crs__pvmax, update pv_crs__pvmax.
+ * cursor mode (including us), and store it in crs->pvcount. If this is
+ * larger than crs->pvmax, update crs->pvmax.
  */
-static void pv_crs__ipccount(void)
+static void pv_crs__ipccount(struct pv_cursor_state *crs)
 {
 	struct shmid_ds buf;
 
 	buf.shm_nattch = 0;
 
-	shmctl(pv_crs__shmid, IPC_STAT, &buf);
-	pv_crs__pvcount = buf.shm_nattch;
+	shmctl(crs->shmid, IPC_STAT, &buf);
+	crs->pvcount = buf.shm_nattch;
 
-	if (pv_crs__pvcount > pv_crs__pvmax)
-		pv_crs__pvmax = pv_crs__pvcount;
+	if (crs->pvcount > crs->pvmax)
+		crs->pvmax = crs->pvcount;
 }
 #endif				/* HAVE_IPC */
 
@@ -217,8 +212,11 @@ static int pv_crs__get_ypos(int terminalfd)
  * count" of one, and so no initialisation occurs. So, we lock the terminal
  * with pv_crs__lock() while we are attaching and checking.
  */
-static int pv_crs__ipcinit(opts_t opts, char *ttyfile, int terminalfd)
+static int pv_crs__ipcinit(pv_state_t state, char *ttyfile,
+			   int terminalfd)
 {
+	struct pv_cursor_state *crs = &(state->cursor);
+	opts_t opts = state->opts;
 	key_t key;
 
 	/*
@@ -234,52 +232,52 @@ static int pv_crs__ipcinit(opts_t opts, char *ttyfile, int terminalfd)
 		return 1;
 	}
 
-	pv_crs__lock(terminalfd);
-	if (pv_crs__noipc) {
+	pv_crs__lock(crs, terminalfd);
+	if (crs->noipc) {
 		fprintf(stderr, "%s: %s: %s\n",
 			opts->program_name,
 			_("failed to lock terminal"), strerror(errno));
 		return 1;
 	}
 
-	pv_crs__shmid = shmget(key, sizeof(int), 0600 | IPC_CREAT);
-	if (pv_crs__shmid < 0) {
+	crs->shmid = shmget(key, sizeof(int), 0600 | IPC_CREAT);
+	if (crs->shmid < 0) {
 		fprintf(stderr, "%s: %s: %s\n",
 			opts->program_name,
 			_("failed to open terminal"), strerror(errno));
-		pv_crs__unlock(terminalfd);
+		pv_crs__unlock(crs, terminalfd);
 		return 1;
 	}
 
-	pv_crs__y_top = shmat(pv_crs__shmid, 0, 0);
+	crs->y_top = shmat(crs->shmid, 0, 0);
 
-	pv_crs__ipccount();
+	pv_crs__ipccount(crs);
 
 	/*
 	 * If nobody else is attached to the shared memory segment, we're
 	 * the first, so we need to initialise the shared memory with our
 	 * current Y cursor co-ordinate.
 	 */
-	if (pv_crs__pvcount < 2) {
-		pv_crs__y_start = pv_crs__get_ypos(terminalfd);
-		*pv_crs__y_top = pv_crs__y_start;
-		pv_crs__y_lastread = pv_crs__y_start;
+	if (crs->pvcount < 2) {
+		crs->y_start = pv_crs__get_ypos(terminalfd);
+		*crs->y_top = crs->y_start;
+		crs->y_lastread = crs->y_start;
 	}
 
-	pv_crs__y_offset = pv_crs__pvcount - 1;
-	if (pv_crs__y_offset < 0)
-		pv_crs__y_offset = 0;
+	crs->y_offset = crs->pvcount - 1;
+	if (crs->y_offset < 0)
+		crs->y_offset = 0;
 
 	/*
 	 * If anyone else had attached to the shared memory segment, we need
 	 * to read the top Y co-ordinate from it.
 	 */
-	if (pv_crs__pvcount > 1) {
-		pv_crs__y_start = *pv_crs__y_top;
-		pv_crs__y_lastread = pv_crs__y_start;
+	if (crs->pvcount > 1) {
+		crs->y_start = *crs->y_top;
+		crs->y_lastread = crs->y_start;
 	}
 
-	pv_crs__unlock(terminalfd);
+	pv_crs__unlock(crs, terminalfd);
 
 	return 0;
 }
@@ -289,8 +287,10 @@ static int pv_crs__ipcinit(opts_t opts, char *ttyfile, int terminalfd)
 /*
  * Initialise the terminal for cursor positioning.
  */
-void pv_crs_init(opts_t opts)
+void pv_crs_init(pv_state_t state)
 {
+	struct pv_cursor_state *crs = &(state->cursor);
+	opts_t opts = state->opts;
 	char *ttyfile;
 	int fd;
 
@@ -312,7 +312,7 @@ void pv_crs_init(opts_t opts)
 		return;
 	}
 #ifdef HAVE_IPC
-	if (pv_crs__ipcinit(opts, ttyfile, fd)) {
+	if (pv_crs__ipcinit(state, ttyfile, fd)) {
 		opts->cursor = 0;
 		close(fd);
 		return;
@@ -323,18 +323,18 @@ void pv_crs_init(opts_t opts)
 	 * co-ordinate. If we are using IPC, then the pv_crs__ipcinit()
 	 * function takes care of this in a more multi-process-friendly way.
 	 */
-	if (pv_crs__noipc) {
+	if (crs->noipc) {
 #else				/* ! HAVE_IPC */
 	if (1) {
 #endif				/* HAVE_IPC */
 		/*
 		 * Get current cursor position + 1.
 		 */
-		pv_crs__lock(fd);
-		pv_crs__y_start = pv_crs__get_ypos(fd);
-		pv_crs__unlock(fd);
+		pv_crs__lock(crs, fd);
+		crs->y_start = pv_crs__get_ypos(fd);
+		pv_crs__unlock(crs, fd);
 
-		if (pv_crs__y_start < 1)
+		if (crs->y_start < 1)
 			opts->cursor = 0;
 	}
 
@@ -344,13 +344,12 @@ void pv_crs_init(opts_t opts)
 
 #ifdef HAVE_IPC
 /*
- * Set the "we need to reinitialise cursor positioning" flag.
+ * Request that cursor positioning be reinitialised; the request is picked
+ * up by the next pv_crs_update() of every transfer in this process.
  */
 void pv_crs_needreinit(void)
 {
-	pv_crs__needreinit += 2;
-	if (pv_crs__needreinit > 3)
-		pv_crs__needreinit = 3;
+	pv_crs__reinit_requests++;
 }
 #endif
 
@@ -360,26 +359,26 @@ void pv_crs_needreinit(void)
  * Reinitialise the cursor positioning code (called if we are backgrounded
  * then foregrounded again).
  */
-void pv_crs_reinit(void)
+static void pv_crs__reinit(struct pv_cursor_state *crs)
 {
-	pv_crs__lock(STDERR_FILENO);
+	pv_crs__lock(crs, STDERR_FILENO);
 
-	pv_crs__needreinit--;
-	if (pv_crs__y_offset < 1)
-		pv_crs__needreinit = 0;
+	crs->needreinit--;
+	if (crs->y_offset < 1)
+		crs->needreinit = 0;
 
-	if (pv_crs__needreinit > 0) {
-		pv_crs__unlock(STDERR_FILENO);
+	if (crs->needreinit > 0) {
+		pv_crs__unlock(crs, STDERR_FILENO);
 		return;
 	}
 
-	pv_crs__y_start = pv_crs__get_ypos(STDERR_FILENO);
+	crs->y_start = pv_crs__get_ypos(STDERR_FILENO);
 
-	if (pv_crs__y_offset < 1)
-		*pv_crs__y_top = pv_crs__y_start;
-	pv_crs__y_lastread = pv_crs__y_start;
+	if (crs->y_offset < 1)
+		*crs->y_top = crs->y_start;
+	crs->y_lastread = crs->y_start;
 
-	pv_crs__unlock(STDERR_FILENO);
+	pv_crs__unlock(crs, STDERR_FILENO);
 }
 #endif
 
@@ -388,28 +387,37 @@ void pv_crs_reinit(void)
  * Output a single-line update, moving the cursor to the correct position to
  * do so.
  */
-void pv_crs_update(opts_t opts, char *str)
+void pv_crs_update(pv_state_t state, char *str)
 {
+	struct pv_cursor_state *crs = &(state->cursor);
+	opts_t opts = state->opts;
 	char pos[32];			 /* RATS: ignore (checked OK) */
 	int y;
 
 #ifdef HAVE_IPC
-	if (!pv_crs__noipc) {
-		if (pv_crs__needreinit)
-			pv_crs_reinit();
-
-		pv_crs__ipccount();
-		if (pv_crs__y_lastread != *pv_crs__y_top) {
-			pv_crs__y_start = *pv_crs__y_top;
-			pv_crs__y_lastread = pv_crs__y_start;
+	if (!crs->noipc) {
+		if (crs->reinit_seen != pv_crs__reinit_requests) {
+			crs->reinit_seen = pv_crs__reinit_requests;
+			crs->needreinit += 2;
+			if (crs->needreinit > 3)
+				crs->needreinit = 3;
+		}
+
+		if (crs->needreinit)
+			pv_crs__reinit(crs);
+
+		pv_crs__ipccount(crs);
+		if (crs->y_lastread != *crs->y_top) {
+			crs->y_start = *crs->y_top;
+			crs->y_lastread = crs->y_start;
 		}
 
-		if (pv_crs__needreinit > 0)
+		if (crs->needreinit > 0)
 			return;
 	}
 #endif				/* HAVE_IPC */
 
-	y = pv_crs__y_start;
+	y = crs->y_start;
 
 #ifdef HAVE_IPC
 	/*
@@ -418,22 +426,22 @@ void pv_crs_update(opts_t opts, char *str)
 	 * scroll the screen (only if we're the first `pv'), and then move
 	 * our initial Y co-ordinate up.
 	 */
-	if (((pv_crs__y_start + pv_crs__pvmax) > opts->height)
-	    && (!pv_crs__noipc)
+	if (((crs->y_start + crs->pvmax) > opts->height)
+	    && (!crs->noipc)
 	    ) {
 		int offs;
 
-		offs = ((pv_crs__y_start + pv_crs__pvmax) - opts->height);
+		offs = ((crs->y_start + crs->pvmax) - opts->height);
 
-		pv_crs__y_start -= offs;
-		if (pv_crs__y_start < 1)
-			pv_crs__y_start = 1;
+		crs->y_start -= offs;
+		if (crs->y_start < 1)
+			crs->y_start = 1;
 
 		/*
 		 * Scroll the screen if we're the first `pv'.
 		 */
-		if (pv_crs__y_offset == 0) {
-			pv_crs__lock(STDERR_FILENO);
+		if (crs->y_offset == 0) {
+			pv_crs__lock(crs, STDERR_FILENO);
 
 			sprintf(pos, "\033[%d;1H", opts->height);
 			write(STDERR_FILENO, pos, strlen(pos));
@@ -441,12 +449,12 @@ void pv_crs_update(opts_t opts, char *str)
 				write(STDERR_FILENO, "\n", 1);
 			}
 
-			pv_crs__unlock(STDERR_FILENO);
+			pv_crs__unlock(crs, STDERR_FILENO);
 		}
 	}
 
-	if (!pv_crs__noipc)
-		y = pv_crs__y_start + pv_crs__y_offset;
+	if (!crs->noipc)
+		y = crs->y_start + crs->y_offset;
 #endif				/* HAVE_IPC */
 
 	/*
@@ -457,28 +465,30 @@ void pv_crs_update(opts_t opts, char *str)
 		y = 1;
 	sprintf(pos, "\033[%d;1H", y);
 
-	pv_crs__lock(STDERR_FILENO);
+	pv_crs__lock(crs, STDERR_FILENO);
 
 	write(STDERR_FILENO, pos, strlen(pos));	/* RATS: ignore */
 	write(STDERR_FILENO, str, strlen(str));	/* RATS: ignore */
 
-	pv_crs__unlock(STDERR_FILENO);
+	pv_crs__unlock(crs, STDERR_FILENO);
 }
 
 
 /*
  * Reposition the cursor to a final position.
  */
-void pv_crs_fini(opts_t opts)
+void pv_crs_fini(pv_state_t state)
 {
+	struct pv_cursor_state *crs = &(state->cursor);
+	opts_t opts = state->opts;
 	char pos[32];			 /* RATS: ignore (checked OK) */
 	int y;
 
-	y = pv_crs__y_start;
+	y = crs->y_start;
 
 #ifdef HAVE_IPC
-	if ((pv_crs__pvmax > 0) && (!pv_crs__noipc))
-		y += pv_crs__pvmax - 1;
+	if ((crs->pvmax > 0) && (!crs->noipc))
+		y += crs->pvmax - 1;
 #endif				/* HAVE_IPC */
 
 	if (y > opts->height)
@@ -492,24 +502,24 @@ void pv_crs_fini(opts_t opts)
 
 	sprintf(pos, "\033[%d;1H\n", y);    /* RATS: ignore */
 
-	pv_crs__lock(STDERR_FILENO);
+	pv_crs__lock(crs, STDERR_FILENO);
 
 	write(STDERR_FILENO, pos, strlen(pos));	/* RATS: ignore */
 
 #ifdef HAVE_IPC
-	pv_crs__ipccount();
-	shmdt((void *) pv_crs__y_top);
+	pv_crs__ipccount(crs);
+	shmdt((void *) crs->y_top);
 
 	/*
 	 * If we are the last instance detaching from the shared memory,
 	 * delete it so it's not left lying around.
 	 */
-	if (pv_crs__pvcount < 2)
-		shmctl(pv_crs__shmid, IPC_RMID, 0);
+	if (crs->pvcount < 2)
+		shmctl(crs->shmid, IPC_RMID, 0);
 
 #endif				/* HAVE_IPC */
 
-	pv_crs__unlock(STDERR_FILENO);
+	pv_crs__unlock(crs, STDERR_FILENO);
 }
 
 /* EOF */
@@ -7,8 +7,7 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
-#include "options.h"
-#include "pv.h"
+#include "pv-internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,7 +18,48 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#define PV_DISPLAY_THREAD 1
+#include <pthread.h>
+#endif
+
+#define FINAL_FRAME_WAIT 1000		    /* msec before forcing last frame */
+
+/*
+ * Everything needed to draw one update, copied from the transfer state so
+ * that it can be drawn by the display thread while the transfer goes on.
+ */
+struct pv__frame {
+	long double elapsed;		 /* seconds since transfer started */
+	long long since_last;		 /* bytes (or lines) since last frame */
+	long long total;		 /* bytes (or lines) so far */
+	unsigned long long bytes;	 /* bytes so far, in line mode */
+	long double rate;		 /* current -L rate limit */
+	unsigned long long size;	 /* state->size at the time */
+	unsigned long long size_bytes;	 /* state->size_bytes at the time */
+	unsigned long long bad_sectors;	 /* bad_sectors at the time */
+	unsigned int width;		 /* opts->width at the time */
+};
+
+#ifdef PV_DISPLAY_THREAD
+/*
+ * A thread drawing the display, so that a slow terminal can't hold up the
+ * transfer. The transfer publishes each frame here, replacing any that
+ * hasn't been drawn yet, and the thread draws whichever is latest.
+ */
+struct pv__display_thread {
+	pthread_t thread;		 /* the display thread */
+	pthread_mutex_t lock;		 /* lock on everything below */
+	pthread_cond_t wake;		 /* signalled on a new frame or stop */
+	struct pv__frame frame;		 /* latest frame */
+	int pending;			 /* set if "frame" is not yet drawn */
+	int stop;			 /* set to exit once "frame" is drawn */
+};
+#endif
 
 
 /*
@@ -76,6 +116,125 @@ static long pv__calc_eta(const long long so_far, const long long total,
 	return (long) amount_left;
 }
 
+/*
+ * Return the square root of "value", which must not be negative, by
+ * Newton's method, to avoid needing the maths library.
+ */
+static long double pv__sqrt(long double value)
+{
+	long double root;
+	int i;
+
+	if (value <= 0)
+		return 0;
+
+	root = value < 1 ? 1 : value;
+	for (i = 0; i < 64; i++) {
+		long double next = (root + value / root) / 2;
+		if (next >= root)
+			break;
+		root = next;
+	}
+
+	return root;
+}
+
+
+/*
+ * Add "sample" to the given window of recent rates, updating its mean and
+ * variance. The window holds the last opts->rate_window samples, equally
+ * weighted, or with --ewma, each new sample is given a weight of 2/(N+1)
+ * and the earlier ones what is left, so that old samples fade away rather
+ * than dropping out all at once.
+ */
+static void pv__window_add(opts_t opts, struct pv_rate_window *w,
+			   long double sample)
+{
+	long double alpha, diff, incr, sum;
+	int size = opts->rate_window;
+	int i;
+
+	if ((opts->ewma) || (w->unwindowed)) {
+		if (w->count == 0) {
+			w->mean = sample;
+			w->var = 0;
+			w->count = 1;
+			return;
+		}
+		alpha = 2.0 / (size + 1);
+		diff = sample - w->mean;
+		incr = alpha * diff;
+		w->mean += incr;
+		w->var = (1 - alpha) * (w->var + diff * incr);
+		if (w->count < size)
+			w->count++;
+		return;
+	}
+
+	/*
+	 * If the ring of samples can't be allocated, fall back to a moving
+	 * average, which doesn't need one.
+	 */
+	if (w->samples == NULL) {
+		w->samples = calloc(size, sizeof(*(w->samples)));
+		if (w->samples == NULL) {
+			w->unwindowed = 1;
+			pv__window_add(opts, w, sample);
+			return;
+		}
+	}
+
+	w->samples[w->next] = sample;
+	w->next = (w->next + 1) % size;
+	if (w->count < size)
+		w->count++;
+
+	sum = 0;
+	for (i = 0; i < w->count; i++)
+		sum += w->samples[i];
+	w->mean = sum / w->count;
+
+	sum = 0;
+	for (i = 0; i < w->count; i++) {
+		diff = w->samples[i] - w->mean;
+		sum += diff * diff;
+	}
+	w->var = w->count > 1 ? sum / (w->count - 1) : 0;
+}
+
+
+/*
+ * Given how much has been transferred, the total to transfer, and a window
+ * of recent rates, return the estimated number of seconds until completion
+ * at the window's mean rate, or -1 if the mean rate is zero. If "range" is
+ * not NULL, it is set to how far either way the estimate could be out by,
+ * going by the standard deviation of the rates.
+ */
+static long pv__calc_eta_window(const long long so_far,
+				const long long total,
+				struct pv_rate_window *w, long *range)
+{
+	long double eta;
+
+	if (w->mean <= 0)
+		return -1;
+
+	eta = ((long double) (total - so_far)) / w->mean;
+	if (eta > 360000000.0)
+		eta = 360000000.0;
+
+	if (range != NULL) {
+		*range = 0;
+		if ((eta > 0) && (w->count > 1))
+			*range = (long) (eta * pv__sqrt(w->var) / w->mean);
+		if ((*range < 0) || (*range > 360000000L))
+			*range = 360000000L;
+	}
+
+	return (long) eta;
+}
+
+
 /*
  * Given a long double value, it is divided or multiplied by the ratio until
  * a value in the range 1.0 to 999.999... is found. The character that
@@ -128,78 +287,151 @@ static void pv__si_prefix(long double *value, char *prefix,
 
 
 /*
- * Structure to hold the internal data for a single display.
+ * Write "value" into "buf" with an SI prefix in powers of "ratio" followed
+ * by "units", using at least 4 characters for the number, and wrapping it
+ * in "[]" if "brackets" is nonzero.
  */
-struct pv_display_state {
-	long percentage;
-	long double prev_elapsed_sec;
-	long double prev_rate;
-	long double prev_trans;
-	char *outbuffer;
-	long outbufsize;
-	opts_t opts;
-};
+static void pv__format_si(char *buf, long double value,
+			  const long double ratio, const char *units,
+			  int brackets)
+{
+	char si_prefix[2] = " ";	 /* RATS: ignore (big enough) */
+
+	pv__si_prefix(&value, si_prefix, ratio);
+
+	/*
+	 * Bounds check, so we don't overrun the prefix buffer. Hopefully
+	 * 97TB/sec is fast enough.
+	 */
+	if (value > 100000)
+		value = 100000;
+
+	if (value > 99.9) {
+		sprintf(buf, brackets ? "[%4ld%.1s%.16s]" : "%4ld%.1s%.16s",
+			(long) value, si_prefix, units);
+	} else {
+		sprintf(buf,
+			brackets ? "[%4.3Lg%.1s%.16s]" : "%4.3Lg%.1s%.16s",
+			value, si_prefix, units);
+	}
+}
+
 
 /*
- * Initialise the given display structure from the given option set. Note
- * that this copies the given "opts" pointer, not the underlying structure,
- * so if "opts" is freed, the state's copy is invalidated and must not be
- * used.
+ * Write the amount "amount" (a rate, if "rate" is nonzero, which is put in
+ * brackets) into "buf" in bytes, or in lines in line mode. If we are
+ * counting both, "bytes" is written first, followed by "amount" in lines.
  */
-static void pv__state_init(struct pv_display_state *state, opts_t opts)
+static void pv__format_amount(opts_t opts, char *buf, long double amount,
+			      long double bytes, int rate)
 {
-	if (state == NULL)
+	if (!opts->linemode) {
+		pv__format_si(buf, amount, 1024.0,
+			      rate ? _("B/s") : _("B"), rate);
+		return;
+	}
+
+	if (!opts->both) {
+		pv__format_si(buf, amount, 1000.0, rate ? _("/s") : "", rate);
 		return;
-	memset(state, 0, sizeof(struct pv_display_state));
-	state->opts = opts;
+	}
+
+	buf[0] = 0;
+	if (rate)
+		strcat(buf, "[");
+	pv__format_si(buf + strlen(buf), bytes, 1024.0,
+		      rate ? _("B/s") : _("B"), 0);
+	strcat(buf, " ");
+	pv__format_si(buf + strlen(buf), amount, 1000.0,
+		      rate ? _("/s") : "", 0);
+	if (rate)
+		strcat(buf, "]");
+}
+
+
+/*
+ * Make sure the output buffer can hold a line of "need" bytes and its
+ * terminating zero, with room after it for a copy of the last line drawn,
+ * reallocating it (and forgetting the last line drawn) if not.
+ *
+ * Returns nonzero on error.
+ */
+static int pv__outbuffer_need(pv_state_t pvstate, long need)
+{
+	struct pv_display_state *state = &(pvstate->display);
+	opts_t opts = pvstate->opts;
+
+	if ((state->outbuffer != NULL) && (state->outbufsize >= need))
+		return 0;
+
+	if (state->outbuffer != NULL)
+		free(state->outbuffer);
+
+	state->outbufsize = need + 80;
+	state->outbuffer = malloc(2 * (state->outbufsize + 16));
+	if (state->outbuffer == NULL) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(errno));
+		pvstate->exit_status |= 64;
+		state->outbufsize = 0;
+		state->drawn = NULL;
+		return 1;
+	}
+
+	state->outbuffer[0] = 0;
+	state->outlen = 0;
+	state->drawn = state->outbuffer + state->outbufsize + 16;
+	state->drawnlen = -1;
+
+	return 0;
 }
 
 
 /*
  * Return a pointer to a string (which must not be freed), containing status
- * information formatted according to the state held within the given
- * structure, where "elapsed_sec" is the seconds elapsed since the transfer
- * started, "bytes_since_last" is the number of bytes transferred since the
- * last update, and "total_bytes" is the total number of bytes transferred
- * so far.
+ * information formatted according to the display state held within the
+ * given transfer state, for the given frame, where "elapsed" is the seconds
+ * elapsed since the transfer started, "since_last" is the number of bytes
+ * transferred since the last update, and "total" is the total number of
+ * bytes transferred so far.
  *
- * If "bytes_since_last" is negative, this is the final update so the rate
- * is given as an an average over the whole transfer; otherwise the current
+ * If "since_last" is negative, this is the final update so the rate is
+ * given as an an average over the whole transfer; otherwise the current
  * rate is shown.
  *
- * In line mode, "bytes_since_last" and "total_bytes" are in lines, not bytes.
+ * In line mode, "since_last" and "total" are in lines, not bytes, and if
+ * we are counting both, the bytes are in "bytes".
  *
- * If "total_bytes" is negative, then free all allocated memory and return
- * NULL.
+ * Nothing is read from the transfer state but the options that can't
+ * change during the transfer, so this can be called from the display
+ * thread.
  */
-static char *pv__format(struct pv_display_state *state,
-			long double elapsed_sec,
-			long long bytes_since_last, long long total_bytes)
+static char *pv__format(pv_state_t pvstate, struct pv__frame *frame)
 {
-	long double time_since_last, rate, transferred;
-	long eta;
+	struct pv_display_state *state = &(pvstate->display);
+	opts_t opts = pvstate->opts;
+	long double elapsed_sec = frame->elapsed;
+	long long bytes_since_last = frame->since_last;
+	long long total_bytes = frame->total;
+	unsigned int width = frame->width;
+	long double time_since_last, rate;
+	long double byte_rate;
+	long double average_byte_rate = 0;
+	long long so_far, total, bytes;
+	struct pv_rate_window *window;
+	long eta, range;
 	int component_count;
 	int static_portion_size;
+	long len, n;
 	char str_transferred[128];	 /* RATS: ignore (big enough) */
 	char str_timer[128];		 /* RATS: ignore (big enough) */
 	char str_rate[128];		 /* RATS: ignore (big enough) */
 	char str_average_rate[128];	 /* RATS: ignore (big enough) */
 	char str_eta[128];		 /* RATS: ignore (big enough) */
-	char si_prefix[2] = " ";	 /* RATS: ignore (big enough) */
-	char *units;
-	long double average_rate;
-
-	/* Quick sanity check - state must exist */
-	if (state == NULL)
-		return NULL;
-
-	/* Negative total transfer - free memory and exit */
-	if (total_bytes < 0) {
-		if (state->outbuffer)
-			free(state->outbuffer);
-		state->outbuffer = NULL;
-		return NULL;
-	}
+	char str_bad[128];		 /* RATS: ignore (big enough) */
+	char str_limit[128];		 /* RATS: ignore (big enough) */
+	long double average_rate = 0;
 
 	/*
 	 * In case the time since the last update is very small, we keep
@@ -207,36 +439,74 @@ static char *pv__format(struct pv_display_state *state,
 	 * adding to that until a reasonable amount of time has passed to
 	 * avoid rate spikes or division by zero.
 	 */
+	bytes = frame->bytes;
 	time_since_last = elapsed_sec - state->prev_elapsed_sec;
 	if (time_since_last <= 0.01) {
 		rate = state->prev_rate;
+		byte_rate = state->prev_byte_rate;
 		state->prev_trans += bytes_since_last;
 	} else {
 		rate =
 		    ((long double) bytes_since_last +
 		     state->prev_trans) / time_since_last;
+		byte_rate =
+		    ((long double) (bytes - state->prev_bytes)) /
+		    time_since_last;
 		state->prev_elapsed_sec = elapsed_sec;
 		state->prev_trans = 0;
+		state->prev_bytes = bytes;
+		if ((opts->rate_window > 0) && (bytes_since_last >= 0)) {
+			pv__window_add(opts, &(state->window), rate);
+			pv__window_add(opts, &(state->byte_window),
+				       byte_rate);
+		}
 	}
+
 	state->prev_rate = rate;
+	state->prev_byte_rate = byte_rate;
 
 	/*
 	 * We only calculate the overall average rate if this is the last
 	 * update or if the average rate display is enabled. Otherwise it's
 	 * not worth the extra CPU cycles.
 	 */
-	if ((bytes_since_last < 0) || (state->opts->average_rate)) {
+	if ((bytes_since_last < 0) || (opts->average_rate)) {
 		/* Sanity check to avoid division by zero */
 		if (elapsed_sec < 0.000001)
 			elapsed_sec = 0.000001;
 		average_rate =
 		    ((long double) total_bytes) /
 		    (long double) elapsed_sec;
-		if (bytes_since_last < 0)
+		average_byte_rate =
+		    ((long double) bytes) / (long double) elapsed_sec;
+		if (bytes_since_last < 0) {
 			rate = average_rate;
+			byte_rate = average_byte_rate;
+		} else if ((opts->rate_window > 0)
+			   && (state->window.count > 0)) {
+			/*
+			 * With --rate-window, the average shown until the
+			 * end is the mean over the last few updates.
+			 */
+			average_rate = state->window.mean;
+			average_byte_rate = state->byte_window.mean;
+		}
 	}
 
-	if (state->opts->size <= 0) {
+	/*
+	 * The percentage and ETA go by lines in line mode, unless we are
+	 * counting both and only know the total number of bytes.
+	 */
+	so_far = total_bytes;
+	total = frame->size;
+	window = &(state->window);
+	if ((opts->both) && (total <= 0)) {
+		so_far = bytes;
+		total = frame->size_bytes;
+		window = &(state->byte_window);
+	}
+
+	if (total <= 0) {
 		/*
 		 * If we don't know the total size of the incoming data,
 		 * then for a percentage, we gradually increase the
@@ -249,54 +519,26 @@ static char *pv__format(struct pv_display_state *state,
 			state->percentage += 2;
 		if (state->percentage > 199)
 			state->percentage = 0;
-	} else if (state->opts->numeric || state->opts->progress) {
+	} else if (opts->numeric || opts->progress) {
 		/*
 		 * If we do know the total size, and we're going to show
 		 * the percentage (numeric mode or a progress bar),
 		 * calculate the percentage completion.
 		 */
-		state->percentage =
-		    pv__calc_percentage(total_bytes, state->opts->size);
-	}
-
-	/*
-	 * Reallocate output buffer if width changes.
-	 */
-	if (state->outbuffer != NULL
-	    && state->outbufsize < (state->opts->width * 2)) {
-		free(state->outbuffer);
-		state->outbuffer = NULL;
-		state->outbufsize = 0;
-	}
-
-	/*
-	 * Allocate output buffer if there isn't one.
-	 */
-	if (state->outbuffer == NULL) {
-		state->outbufsize = (2 * state->opts->width) + 80;
-		if (state->opts->name)
-			state->outbufsize += strlen(state->opts->name);	/* RATS: ignore */
-		state->outbuffer = malloc(state->outbufsize + 16);
-		if (state->outbuffer == NULL) {
-			fprintf(stderr, "%s: %s: %s\n",
-				state->opts->program_name,
-				_("buffer allocation failed"),
-				strerror(errno));
-			state->opts->exit_status |= 64;
-			return NULL;
-		}
-		state->outbuffer[0] = 0;
+		state->percentage = pv__calc_percentage(so_far, total);
 	}
 
 	/* In numeric output mode, our output is just a number. */
-	if (state->opts->numeric) {
+	if (opts->numeric) {
+		if (pv__outbuffer_need(pvstate, 32))
+			return NULL;
 		if (state->percentage > 100) {
 			/* As mentioned above, we go 0-100, then 100-0. */
-			sprintf(state->outbuffer, "%ld\n",
-				200 - state->percentage);
+			state->outlen = sprintf(state->outbuffer, "%ld\n",
+						200 - state->percentage);
 		} else {
-			sprintf(state->outbuffer, "%ld\n",
-				state->percentage);
+			state->outlen = sprintf(state->outbuffer, "%ld\n",
+						state->percentage);
 		}
 		return state->outbuffer;
 	}
@@ -316,12 +558,14 @@ static char *pv__format(struct pv_display_state *state,
 	str_rate[0] = 0;
 	str_average_rate[0] = 0;
 	str_eta[0] = 0;
+	str_bad[0] = 0;
+	str_limit[0] = 0;
 
 	/* If we're showing a name, add it to the list and the length. */
-	if (state->opts->name) {
+	if (opts->name) {
 		int name_length;
 
-		name_length = strlen(state->opts->name);
+		name_length = strlen(opts->name);
 		if (name_length < 9)
 			name_length = 9;
 		if (name_length > 500)
@@ -332,35 +576,16 @@ static char *pv__format(struct pv_display_state *state,
 	}
 
 	/* If we're showing bytes transferred, set up the display string. */
-	if (state->opts->bytes) {
-		transferred = total_bytes;
-
-		if (state->opts->linemode) {
-			pv__si_prefix(&transferred, si_prefix, 1000.0);
-			units = "";
-		} else {
-			pv__si_prefix(&transferred, si_prefix, 1024.0);
-			units = _("B");
-		}
-
-		/* Bounds check, so we don't overrun the prefix buffer. */
-		if (transferred > 100000)
-			transferred = 100000;
-
-		if (transferred > 99.9) {
-			sprintf(str_transferred, "%4ld%.1s%.16s",
-				(long) transferred, si_prefix, units);
-		} else {
-			sprintf(str_transferred, "%4.3Lg%.1s%.16s",
-				transferred, si_prefix, units);
-		}
+	if (opts->bytes) {
+		pv__format_amount(opts, str_transferred, total_bytes, bytes,
+				  0);
 
 		component_count++;
 		static_portion_size += strlen(str_transferred);
 	}
 
 	/* Timer - set up the display string. */
-	if (state->opts->timer) {
+	if (opts->timer) {
 		/*
 		 * Bounds check, so we don't overrun the prefix buffer. This
 		 * does mean that the timer will stop at a 100,000 hours,
@@ -379,65 +604,70 @@ static char *pv__format(struct pv_display_state *state,
 	}
 
 	/* Rate - set up the display string. */
-	if (state->opts->rate) {
-		if (state->opts->linemode) {
-			pv__si_prefix(&rate, si_prefix, 1000.0);
-			units = _("/s");
-		} else {
-			pv__si_prefix(&rate, si_prefix, 1024.0);
-			units = _("B/s");
-		}
+	if (opts->rate) {
+		pv__format_amount(opts, str_rate, rate, byte_rate, 1);
 
-		/*
-		 * Bounds check, so we don't overrun the prefix buffer.
-		 * Hopefully 97TB/sec is fast enough.
-		 */
-		if (rate > 100000)
-			rate = 100000;
+		component_count++;
+		static_portion_size += strlen(str_rate);
+	}
 
-		if (rate > 99.9) {
-			sprintf(str_rate, "[%4ld%.1s%.16s]", (long) rate,
-				si_prefix, units);
+	/*
+	 * Rate limit, if it changes during the transfer because of a
+	 * schedule, ramp, deadline or adaptive limit (but not on the final
+	 * update) - set up the display string.
+	 */
+	if ((opts->rate)
+	    && ((opts->rate_schedule != NULL) || (opts->ramp > 0)
+		|| (opts->finish_by != NULL) || (opts->adaptive_limit > 0))
+	    && (bytes_since_last >= 0)) {
+		if (frame->rate > 0) {
+			sprintf(str_limit, "{%.16s ", _("limit"));
+			pv__format_si(str_limit + strlen(str_limit),
+				      frame->rate, 1024.0, _("B/s"), 0);
+			strcat(str_limit, "}");
 		} else {
-			sprintf(str_rate, "[%4.3Lg%.1s%.16s]", rate,
-				si_prefix, units);
+			sprintf(str_limit, "{%.16s}", _("unlimited"));
 		}
 
 		component_count++;
-		static_portion_size += strlen(str_rate);
+		static_portion_size += strlen(str_limit);
 	}
 
 	/* Average rate - set up the display string. */
-	if (state->opts->average_rate) {
-		if (state->opts->linemode) {
-			pv__si_prefix(&average_rate, si_prefix, 1000.0);
-			units = _("/s");
-		} else {
-			pv__si_prefix(&average_rate, si_prefix, 1024.0);
-			units = _("B/s");
-		}
+	if (opts->average_rate) {
+		pv__format_amount(opts, str_average_rate, average_rate,
+				  average_byte_rate, 1);
 
-		/* Bounds check, as above. */
-		if (average_rate > 100000)
-			average_rate = 100000;
+		component_count++;
+		static_portion_size += strlen(str_average_rate);
+	}
 
-		if (average_rate > 99.9) {
-			sprintf(str_average_rate, "[%4ld%.1s%.16s]",
-				(long) average_rate, si_prefix, units);
-		} else {
-			sprintf(str_average_rate, "[%4.3Lg%.1s%.16s]",
-				average_rate, si_prefix, units);
-		}
+	/* Unreadable blocks skipped (only if any) - set up the string. */
+	if (opts->skip_errors && frame->bad_sectors > 0) {
+		sprintf(str_bad, "{%llu %.16s}", frame->bad_sectors,
+			_("bad"));
 
 		component_count++;
-		static_portion_size += strlen(str_average_rate);
+		static_portion_size += strlen(str_bad);
 	}
 
 	/* ETA (only if size is known) - set up the display string. */
-	if (state->opts->eta && state->opts->size > 0) {
-		eta =
-		    pv__calc_eta(total_bytes, state->opts->size,
-				 elapsed_sec);
+	if (opts->eta && total > 0) {
+		/*
+		 * With --rate-window, the ETA goes by the recent rate rather
+		 * than the average over the whole transfer, unless nothing
+		 * has been transferred recently.
+		 */
+		eta = -1;
+		range = -1;
+		if ((opts->rate_window > 0) && (window->count > 0))
+			eta = pv__calc_eta_window(so_far, total, window,
+						  opts->eta_range ? &range :
+						  NULL);
+		if (eta < 0) {
+			eta = pv__calc_eta(so_far, total, elapsed_sec);
+			range = -1;
+		}
 
 		if (eta < 0)
 			eta = 0;
@@ -449,15 +679,21 @@ static char *pv__format(struct pv_display_state *state,
 		if (eta > (long) 360000000L)
 			eta = (long) 360000000L;
 
-		sprintf(str_eta, "%.16s %ld:%02ld:%02ld", _("ETA"),
-			eta / 3600, (eta / 60) % 60, eta % 60);
+		n = sprintf(str_eta, "%.16s %ld:%02ld:%02ld", _("ETA"),
+			    eta / 3600, (eta / 60) % 60, eta % 60);
+
+		/* With --eta-range, add how far out the ETA could be. */
+		if (range >= 0) {
+			sprintf(str_eta + n, " +/-%ld:%02ld:%02ld",
+				range / 3600, (range / 60) % 60, range % 60);
+		}
 
 		/*
 		 * If this is the final update, show a blank space where the
 		 * ETA used to be.
 		 */
 		if (bytes_since_last < 0) {
-			int i;
+			size_t i;
 			for (i = 0; i < sizeof(str_eta) && str_eta[i] != 0;
 			     i++) {
 				str_eta[i] = ' ';
@@ -471,85 +707,348 @@ static char *pv__format(struct pv_display_state *state,
 	/*
 	 * We now have all the static portions built; all that is left is
 	 * the dynamically sized progress bar. So now we assemble the
-	 * output buffer, inserting the progress bar at the appropriate
-	 * point with the appropriate width.
+	 * output buffer in a single pass, keeping track of its length in
+	 * "len", inserting the progress bar at the appropriate point with
+	 * the appropriate width.
+	 *
+	 * The line is at most the name, the static portions, a space
+	 * between each component, and a progress bar no wider than the
+	 * terminal plus its brackets and percentage.
 	 */
+	n = 0;
+	if (opts->name) {
+		n = strlen(opts->name);	    /* RATS: ignore */
+		if (n < 9)
+			n = 9;
+		n++;
+	}
+	n += strlen(str_transferred) + strlen(str_timer) + strlen(str_rate)
+	    + strlen(str_limit) + strlen(str_average_rate) + strlen(str_bad)
+	    + strlen(str_eta) + component_count + width + 32;
+	if (pv__outbuffer_need(pvstate, n))
+		return NULL;
 
-	state->outbuffer[0] = 0;
+	len = 0;
 
-	if (state->opts->name) {
-		sprintf(state->outbuffer, "%9s:", state->opts->name);	/* RATS: ignore (OK) */
+	if (opts->name) {
+		len = sprintf(state->outbuffer, "%9s:", opts->name);	/* RATS: ignore (OK) */
 	}
 #define PV_APPEND(x) if (x[0] != 0) { \
-	if (state->outbuffer[0] != 0) \
-		strcat(state->outbuffer, " "); \
-	strcat(state->outbuffer, x); \
+	if (len > 0) \
+		state->outbuffer[len++] = ' '; \
+	n = strlen(x); \
+	memcpy(state->outbuffer + len, x, n); \
+	len += n; \
 	}
 
 	PV_APPEND(str_transferred);
 	PV_APPEND(str_timer);
 	PV_APPEND(str_rate);
+	PV_APPEND(str_limit);
 	PV_APPEND(str_average_rate);
+	PV_APPEND(str_bad);
 
-	if (state->opts->progress) {
+	if (opts->progress) {
 		char pct[16];		 /* RATS: ignore (big enough) */
-		int available_width, i;
+		int available_width, filled;
 
-		if (state->outbuffer[0] != 0)
-			strcat(state->outbuffer, " ");
-		strcat(state->outbuffer, "[");
+		if (len > 0)
+			state->outbuffer[len++] = ' ';
+		state->outbuffer[len++] = '[';
 
-		if (state->opts->size > 0) {
+		if (total > 0) {
 			if (state->percentage < 0)
 				state->percentage = 0;
 			if (state->percentage > 100000)
 				state->percentage = 100000;
-			sprintf(pct, "%2ld%%", state->percentage);
+			n = sprintf(pct, "%2ld%%", state->percentage);
 			available_width =
-			    state->opts->width - static_portion_size -
-			    component_count - strlen(pct) - 3;
-
-			for (i = 0;
-			     i <
-			     (available_width * state->percentage) / 100 -
-			     1; i++) {
-				if (i < available_width)
-					strcat(state->outbuffer, "=");
-			}
-			if (i < available_width) {
-				strcat(state->outbuffer, ">");
-				i++;
+			    (int) width - static_portion_size -
+			    component_count - n - 3;
+
+			/*
+			 * "filled" cells of "=", then a ">" if there is
+			 * room, then spaces for the rest.
+			 */
+			filled =
+			    (available_width * state->percentage) / 100 - 1;
+			if (filled < 0)
+				filled = 0;
+			if (filled < available_width) {
+				memset(state->outbuffer + len, '=', filled);
+				len += filled;
+				state->outbuffer[len++] = '>';
+				filled++;
+			} else if (available_width > 0) {
+				memset(state->outbuffer + len, '=',
+				       available_width);
+				len += available_width;
 			}
-			for (; i < available_width; i++) {
-				strcat(state->outbuffer, " ");
+			if (filled < available_width) {
+				memset(state->outbuffer + len, ' ',
+				       available_width - filled);
+				len += available_width - filled;
 			}
-			strcat(state->outbuffer, "] ");
-			strcat(state->outbuffer, pct);	/* RATS: ignore (OK) */
+			state->outbuffer[len++] = ']';
+			state->outbuffer[len++] = ' ';
+			memcpy(state->outbuffer + len, pct, n);
+			len += n;
 		} else {
 			int p = state->percentage;
 			available_width =
-			    state->opts->width - static_portion_size -
+			    (int) width - static_portion_size -
 			    component_count - 5;
 			if (p > 100)
 				p = 200 - p;
-			for (i = 0; i < (available_width * p) / 100; i++) {
-				if (i < available_width)
-					strcat(state->outbuffer, " ");
+
+			/*
+			 * "filled" spaces, then "<=>", then spaces for the
+			 * rest.
+			 */
+			filled = (available_width * p) / 100;
+			if (filled < 0)
+				filled = 0;
+			if (filled > available_width)
+				filled = available_width;
+			if (filled > 0) {
+				memset(state->outbuffer + len, ' ', filled);
+				len += filled;
 			}
-			strcat(state->outbuffer, "<=>");
-			for (; i < available_width; i++) {
-				strcat(state->outbuffer, " ");
+			memcpy(state->outbuffer + len, "<=>", 3);
+			len += 3;
+			if (filled < available_width) {
+				memset(state->outbuffer + len, ' ',
+				       available_width - filled);
+				len += available_width - filled;
 			}
-			strcat(state->outbuffer, "]");
+			state->outbuffer[len++] = ']';
 		}
 	}
 
 	PV_APPEND(str_eta);
 
+	state->outbuffer[len] = 0;
+	state->outlen = len;
+
 	return state->outbuffer;
 }
 
 
+/*
+ * Write all of the "count" buffers in "iov" to standard error, carrying on
+ * after a short write. Returns nonzero if they could not all be written.
+ */
+static int pv__writev_all(struct iovec *iov, int count)
+{
+	ssize_t r;
+
+	while (count > 0) {
+		r = writev(STDERR_FILENO, iov, count);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		while ((count > 0) && ((size_t) r >= iov->iov_len)) {
+			r -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = ((char *) (iov->iov_base)) + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write the given frame to standard error, unless it would look just the
+ * same as the last one. A frame only counts as drawn once all of it has
+ * been written.
+ */
+static void pv__display_draw(pv_state_t state, struct pv__frame *frame)
+{
+	struct pv_display_state *ds = &(state->display);
+	opts_t opts = state->opts;
+	struct iovec iov[2];
+	char *display;
+
+	display = pv__format(state, frame);
+	if (display == NULL)
+		return;
+
+	if (opts->numeric) {
+		write(STDERR_FILENO, display, ds->outlen);	/* RATS: ignore */
+	} else if (opts->cursor) {
+		pv_crs_update(state, display);
+	} else {
+		if ((ds->drawnlen == ds->outlen)
+		    && (memcmp(ds->drawn, display, ds->outlen) == 0))
+			return;
+		iov[0].iov_base = display;
+		iov[0].iov_len = ds->outlen;
+		iov[1].iov_base = "\r";
+		iov[1].iov_len = 1;
+		if (pv__writev_all(iov, 2)) {
+			ds->drawnlen = -1;
+			return;
+		}
+		memcpy(ds->drawn, display, ds->outlen);
+		ds->drawnlen = ds->outlen;
+	}
+}
+
+
+#ifdef PV_DISPLAY_THREAD
+/*
+ * Draw each frame published by pv__display_publish() until told to stop.
+ *
+ * If standard error can't be written to within an update interval, the
+ * frame is dropped rather than waiting any longer, and the amount it
+ * carried is added to the next frame's rate calculation. The final frame
+ * is never dropped: if standard error still isn't ready after
+ * FINAL_FRAME_WAIT milliseconds, it is written anyway, waiting as long as
+ * it takes, so that the last status line is not lost.
+ *
+ * Standard error is left in blocking mode, since its file status flags
+ * are shared with every other process using it, such as the shell.
+ */
+static void *pv__display_run(void *arg)
+{
+	pv_state_t state = arg;
+	struct pv__display_thread *dt = state->display.thread;
+	struct pv__frame frame;
+	struct pollfd pfd;
+	int timeout, final;
+
+	pthread_mutex_lock(&(dt->lock));
+	while (1) {
+		while ((!dt->pending) && (!dt->stop))
+			pthread_cond_wait(&(dt->wake), &(dt->lock));
+		if (!dt->pending)
+			break;
+		frame = dt->frame;
+		dt->pending = 0;
+		pthread_mutex_unlock(&(dt->lock));
+
+		final = (frame.since_last < 0);
+		timeout = FINAL_FRAME_WAIT;
+		if (!final)
+			timeout = (int) (1000.0 * state->opts->interval);
+
+		pfd.fd = STDERR_FILENO;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if ((poll(&pfd, 1, timeout) > 0) || (final)) {
+			pv__display_draw(state, &frame);
+		} else {
+			state->display.prev_trans += frame.since_last;
+		}
+
+		pthread_mutex_lock(&(dt->lock));
+	}
+	pthread_mutex_unlock(&(dt->lock));
+
+	return NULL;
+}
+
+
+/*
+ * Hand the given frame to the display thread, starting it if necessary,
+ * replacing any earlier frame it hasn't got round to drawing yet. Returns
+ * nonzero if there is no display thread, so the caller must draw the frame
+ * itself.
+ */
+static int pv__display_publish(pv_state_t state, struct pv__frame *frame)
+{
+	struct pv__display_thread *dt = state->display.thread;
+
+	if (dt == NULL) {
+		if (state->display.unthreaded)
+			return 1;
+		dt = calloc(1, sizeof(*dt));
+		if (dt == NULL) {
+			state->display.unthreaded = 1;
+			return 1;
+		}
+		pthread_mutex_init(&(dt->lock), NULL);
+		pthread_cond_init(&(dt->wake), NULL);
+		state->display.thread = dt;
+		if (pthread_create(&(dt->thread), NULL, pv__display_run, state)
+		    != 0) {
+			pthread_cond_destroy(&(dt->wake));
+			pthread_mutex_destroy(&(dt->lock));
+			free(dt);
+			state->display.thread = NULL;
+			state->display.unthreaded = 1;
+			return 1;
+		}
+	}
+
+	pthread_mutex_lock(&(dt->lock));
+	if ((dt->pending) && (frame->since_last >= 0))
+		frame->since_last += dt->frame.since_last;
+	dt->frame = *frame;
+	dt->pending = 1;
+	pthread_cond_signal(&(dt->wake));
+	pthread_mutex_unlock(&(dt->lock));
+
+	return 0;
+}
+#endif				/* PV_DISPLAY_THREAD */
+
+
+/*
+ * Stop the display thread, if there is one, once it has drawn the last
+ * frame it was given.
+ */
+void pv_display_stop(pv_state_t state)
+{
+#ifdef PV_DISPLAY_THREAD
+	struct pv__display_thread *dt = state->display.thread;
+
+	if (dt == NULL)
+		return;
+
+	pthread_mutex_lock(&(dt->lock));
+	dt->stop = 1;
+	pthread_cond_signal(&(dt->wake));
+	pthread_mutex_unlock(&(dt->lock));
+
+	pthread_join(dt->thread, NULL);
+	pthread_cond_destroy(&(dt->wake));
+	pthread_mutex_destroy(&(dt->lock));
+
+	free(dt);
+	state->display.thread = NULL;
+#endif				/* PV_DISPLAY_THREAD */
+}
+
+
+/*
+ * Free the memory used by the display.
+ */
+void pv_display_free(pv_state_t state)
+{
+	pv_display_stop(state);
+	if (state->display.outbuffer)
+		free(state->display.outbuffer);
+	state->display.outbuffer = NULL;
+	state->display.outbufsize = 0;
+	state->display.drawn = NULL;
+	if (state->display.window.samples)
+		free(state->display.window.samples);
+	state->display.window.samples = NULL;
+	if (state->display.byte_window.samples)
+		free(state->display.byte_window.samples);
+	state->display.byte_window.samples = NULL;
+	state->display.line = NULL;
+}
+
+
 /*
  * Output status information on standard error, where "esec" is the seconds
  * elapsed since the transfer started, "sl" is the number of bytes transferred
@@ -561,40 +1060,48 @@ static char *pv__format(struct pv_display_state *state,
  *
  * In line mode, "sl" and "tot" are in lines, not bytes.
  *
- * If "opts" is NULL, then free all allocated memory and return.
+ * The formatting and writing is done by a separate display thread where
+ * possible, so that a slow or blocked terminal doesn't slow the transfer
+ * down; pv_display_stop() waits for it to finish.
  */
-void pv_display(opts_t opts, long double esec, long long sl, long long tot)
+void pv_display(pv_state_t state, long double esec, long long sl,
+		long long tot)
 {
-	static struct pv_display_state state;
-	static int initialised = 0;
+	opts_t opts = state->opts;
+	struct pv__frame frame;
 	char *display;
 
-	if (!initialised) {
-		pv__state_init(&state, opts);
-		initialised = 1;
-	}
+	pv_sig_checkbg();
+
+	frame.elapsed = esec;
+	frame.since_last = sl;
+	frame.total = tot;
+	frame.bytes = state->loop.bytes_total;
+	frame.rate = state->loop.rate;
+	frame.size = state->size;
+	frame.size_bytes = state->size_bytes;
+	frame.bad_sectors = state->transfer.bad_sectors;
+	frame.width = opts->width;
 
-	if (opts == NULL) {
-		if (initialised)
-			(void) pv__format(&state, 0, 0, -1);
-		initialised = 0;
+	/*
+	 * If the caller is drawing several transfers at once, just keep the
+	 * line for it to pick up.
+	 */
+	if ((state->display.buffered) && (!opts->numeric)) {
+		display = pv__format(state, &frame);
+		if (display == NULL)
+			return;
+		state->display.line = display;
+		state->display.changed = 1;
 		return;
 	}
 
-	pv_sig_checkbg();
-
-	display = pv__format(&state, esec, sl, tot);
-	if (display == NULL)
+#ifdef PV_DISPLAY_THREAD
+	if (pv__display_publish(state, &frame) == 0)
 		return;
+#endif
 
-	if (opts->numeric) {
-		write(STDERR_FILENO, display, strlen(display));	/* RATS: ignore */
-	} else if (opts->cursor) {
-		pv_crs_update(opts, display);
-	} else {
-		write(STDERR_FILENO, display, strlen(display));	/* RATS: ignore */
-		write(STDERR_FILENO, "\r", 1);
-	}
+	pv__display_draw(state, &frame);
 }
 
 /* EOF */
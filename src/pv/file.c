@@ -7,8 +7,9 @@
 #define _GNU_SOURCE 1
 #include <limits.h>
 
+#include "pv-internal.h"
+
 #include <stdio.h>
-#include "options.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -23,29 +24,797 @@
 #include "config.h"
 #endif
 
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#define PV_SCAN_THREADS 1
+#include <pthread.h>
+#endif
+
+#define SCAN_BLOCK_SIZE	4194304		    /* read size when counting lines */
+#define SCAN_CHUNK_SIZE	67108864	    /* bytes per line-counting job */
+#define SCAN_THREADS_MAX 16		    /* most line-counting threads */
+
+#define ESTIMATE_SAMPLE_SIZE 65536	    /* bytes per line-count sample */
+#define ESTIMATE_SAMPLES_MIN 32		    /* samples in the first round */
+#define ESTIMATE_SAMPLES_MAX 1024	    /* most samples per file */
+#define ESTIMATE_PRECISION 0.01		    /* target relative error */
+
+/*
+ * A range of a file to count the lines in, and the result.
+ */
+struct pv__scan_job {
+	int file;			 /* index of file in opts->argv */
+	int fd;				 /* file descriptor to read from */
+	unsigned long long offset;	 /* where to start counting */
+	unsigned long long length;	 /* bytes to count, 0 for all to EOF */
+	unsigned long long start;	 /* "offset" in all the input together */
+	unsigned long long end;		 /* where the job ends, likewise */
+	unsigned long long lines;	 /* number of lines counted */
+	int error;			 /* errno of read error, if any */
+};
+
+struct pv__count_bg;
+
+/*
+ * The list of jobs shared by the line-counting threads.
+ */
+struct pv__scan_queue {
+	struct pv__scan_job *jobs;	 /* array of jobs */
+	int count;			 /* number of jobs in the array */
+	int next;			 /* index of next job to be taken */
+	unsigned char delimiter;	 /* byte that ends each line */
+	volatile int *cancel;		 /* if set and nonzero, stop early */
+#ifdef PV_SCAN_THREADS
+	pthread_mutex_t lock;		 /* lock on "next" */
+	struct pv__count_bg *bg;	 /* background count to race, if any */
+	unsigned long long floor;	 /* start of the last job taken */
+	int overtaken;			 /* set if the transfer got there first */
+#endif
+};
+
+#ifdef PV_SCAN_THREADS
+/*
+ * A line count running in its own thread while the transfer goes on, with
+ * its own copy of the options, and its own state for the result, so that
+ * the two don't interfere.
+ */
+struct pv__count_bg {
+	struct opts_s opts;		 /* copy of options */
+	struct pv_state_s state;	 /* state holding the result */
+	pthread_t thread;		 /* the counting thread */
+	pthread_mutex_t lock;		 /* lock on "done" and "cursor_*" */
+	int done;			 /* set once the count is complete */
+	volatile int cancel;		 /* set to stop counting early */
+	unsigned long long cursor_bytes; /* bytes the transfer has written */
+	unsigned long long cursor_lines; /* lines the transfer has written */
+};
+#endif
+
+
+/*
+ * Count the lines in the range of the file given by "job", from "queue",
+ * using "buf", which must be SCAN_BLOCK_SIZE bytes long. Reading is done
+ * with pread() so that several jobs can share the same file descriptor.
+ */
+static void pv__scan_job_run(struct pv__scan_queue *queue,
+			     struct pv__scan_job *job, unsigned char *buf)
+{
+	unsigned long long offset, remaining;
+	size_t want;
+	ssize_t got;
+
+	offset = job->offset;
+	remaining = job->length;
+
+	while ((job->length == 0) || (remaining > 0)) {
+		if ((queue->cancel != NULL) && (*(queue->cancel)))
+			break;
+		want = SCAN_BLOCK_SIZE;
+		if ((job->length > 0) && (remaining < want))
+			want = remaining;
+		got = pread64(job->fd, buf, want, offset);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			job->error = errno;
+			break;
+		} else if (got == 0) {
+			break;
+		}
+		job->lines += pv_memcount(buf, got, queue->delimiter);
+		offset += got;
+		if (job->length > 0)
+			remaining -= got;
+	}
+}
+
+
+/*
+ * Return the index of the next job to take from the given queue, which
+ * must be locked, or -1 if there are none left.
+ *
+ * When racing a transfer, jobs are taken from the end of the input
+ * backwards, and no more are taken once the next one is wholly behind the
+ * transfer, whose lines are already counted; queue->floor is left at the
+ * start of the last job taken.
+ */
+static int pv__scan_next(struct pv__scan_queue *queue)
+{
+	int n;
+#ifdef PV_SCAN_THREADS
+	int behind;
+#endif
+
+	if (queue->next >= queue->count)
+		return -1;
+	n = queue->next++;
+
+#ifdef PV_SCAN_THREADS
+	if (queue->bg == NULL)
+		return n;
+
+	n = queue->count - 1 - n;
+	pthread_mutex_lock(&(queue->bg->lock));
+	behind = (queue->jobs[n].end <= queue->bg->cursor_bytes);
+	pthread_mutex_unlock(&(queue->bg->lock));
+
+	if (behind) {
+		queue->next = queue->count;
+		queue->overtaken = 1;
+		return -1;
+	}
+	queue->floor = queue->jobs[n].start;
+#endif
+
+	return n;
+}
+
+
+/*
+ * Take jobs from the given queue and run them until there are none left.
+ * This is run by each line-counting thread, including the main one.
+ */
+static void *pv__scan_worker(void *arg)
+{
+	struct pv__scan_queue *queue = arg;
+	unsigned char *buf;
+	int n;
+
+	buf = malloc(SCAN_BLOCK_SIZE);
+	if (buf == NULL)
+		return NULL;
+
+	while (1) {
+#ifdef PV_SCAN_THREADS
+		pthread_mutex_lock(&(queue->lock));
+#endif
+		n = pv__scan_next(queue);
+#ifdef PV_SCAN_THREADS
+		pthread_mutex_unlock(&(queue->lock));
+#endif
+		if (n < 0)
+			break;
+		pv__scan_job_run(queue, &(queue->jobs[n]), buf);
+	}
+
+	free(buf);
+	return arg;
+}
+
+
+/*
+ * Run all the jobs in the given queue, spreading them across one thread
+ * per CPU, up to SCAN_THREADS_MAX. Jobs not taken by any thread (because
+ * none could allocate a buffer) are left with queue->next < queue->count.
+ */
+static void pv__scan_run(struct pv__scan_queue *queue)
+{
+#ifdef PV_SCAN_THREADS
+	pthread_t threads[SCAN_THREADS_MAX];
+	long nthreads;
+	int started, i;
+
+	nthreads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads > queue->count)
+		nthreads = queue->count;
+	if (nthreads > SCAN_THREADS_MAX)
+		nthreads = SCAN_THREADS_MAX;
+
+	/*
+	 * Make sure the counting function has been chosen before any
+	 * threads can race to choose it.
+	 */
+	pv_memcount("", 0, queue->delimiter);
+
+	pthread_mutex_init(&(queue->lock), NULL);
+
+	started = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&(threads[started]), NULL,
+				   pv__scan_worker, queue) == 0)
+			started++;
+	}
+
+	pv__scan_worker(queue);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&(queue->lock));
+#else				/* !PV_SCAN_THREADS */
+	pv__scan_worker(queue);
+#endif				/* PV_SCAN_THREADS */
+}
+
+
+/*
+ * Open each of the input files for line counting, storing the descriptors
+ * in "fds".
+ *
+ * Returns nonzero if any of the files is not a regular file or can't be
+ * opened.
+ */
+static int pv__scan_open(pv_state_t state, int *fds)
+{
+	opts_t opts = state->opts;
+	struct stat64 sb;
+	int rc, i;
+
+	for (i = 0; i < opts->argc; i++) {
+		if (strcmp(opts->argv[i], "-") == 0) {
+			rc = fstat64(STDIN_FILENO, &sb);
+			if ((rc != 0) || (!S_ISREG(sb.st_mode)))
+				return 1;
+			fds[i] = dup(STDIN_FILENO);
+		} else {
+			rc = stat64(opts->argv[i], &sb);
+			if ((rc != 0) || (!S_ISREG(sb.st_mode)))
+				return 1;
+			fds[i] = open64(opts->argv[i], O_RDONLY);
+		}
+
+		if (fds[i] < 0) {
+			fprintf(stderr, "%s: %s: %s\n", opts->program_name,
+				opts->argv[i], strerror(errno));
+			state->exit_status |= 2;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Count the lines between "from" and "to" in all of the input together,
+ * where file "i" of those in "fds" is "sizes[i]" bytes long and starts at
+ * "starts[i]", putting the result in *lines.
+ *
+ * Returns nonzero on error.
+ */
+static int pv__scan_range(opts_t opts, int *fds, unsigned long long *sizes,
+			  unsigned long long *starts, unsigned long long from,
+			  unsigned long long to, unsigned long long *lines)
+{
+	struct pv__scan_queue queue;
+	unsigned long long first, last;
+	int failed, i, n;
+
+	*lines = 0;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.delimiter = opts->delimiter;
+
+	queue.jobs = calloc(opts->argc + 1, sizeof(*(queue.jobs)));
+	if (queue.jobs == NULL)
+		return 1;
+
+	for (i = 0, n = 0; i < opts->argc; i++) {
+		first = starts[i];
+		last = starts[i] + sizes[i];
+		if (first < from)
+			first = from;
+		if (last > to)
+			last = to;
+		if (first >= last)
+			continue;
+		queue.jobs[n].file = i;
+		queue.jobs[n].fd = fds[i];
+		queue.jobs[n].offset = first - starts[i];
+		queue.jobs[n].length = last - first;
+		n++;
+	}
+	queue.count = n;
+
+	pv__scan_run(&queue);
+
+	failed = (queue.next < queue.count);
+	for (n = 0; n < queue.count; n++) {
+		*lines += queue.jobs[n].lines;
+		if (queue.jobs[n].error != 0)
+			failed = 1;
+	}
+
+	free(queue.jobs);
+
+	return failed;
+}
+
+
+/*
+ * Divide the files in "fds" opened by pv__scan_open() into jobs, run them,
+ * and set state->size to the total number of lines, and each entry in
+ * "counts" to the number of lines in that file. Files with "cached" set
+ * already have their count in "counts", and are not read.
+ *
+ * If "bg" is not NULL, the count is racing the transfer (see
+ * pv_count_start()), so it works backwards from the end of the input and
+ * stops once it meets the transfer, rather than reading again what the
+ * transfer has already read. The total is then the number of lines the
+ * transfer has written plus the number of lines after that point, and
+ * "partial" is set for each file whose entry in "counts" doesn't cover
+ * the whole file. Counting also stops early once bg->cancel is nonzero.
+ *
+ * Returns nonzero on error, or if counting was cancelled.
+ */
+static int pv__scan_files(pv_state_t state, int *fds, char *cached,
+			  unsigned long long *counts, char *partial,
+			  struct pv__count_bg *bg)
+{
+	opts_t opts = state->opts;
+	struct pv__scan_queue queue;
+	struct stat64 sb;
+	unsigned long long *sizes, *starts;
+	unsigned long long offset, total;
+	volatile int *cancel;
+	int jobcount, failed, i, n;
+#ifdef PV_SCAN_THREADS
+	unsigned long long cursor_bytes, cursor_lines, ahead, passed;
+#endif
+
+	cancel = NULL;
+#ifdef PV_SCAN_THREADS
+	if (bg != NULL)
+		cancel = &(bg->cancel);
+#endif
+
+	memset(&queue, 0, sizeof(queue));
+	queue.delimiter = opts->delimiter;
+	queue.cancel = cancel;
+
+	sizes = calloc(2 * (opts->argc + 1), sizeof(*sizes));
+	if (sizes == NULL) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(errno));
+		state->exit_status |= 64;
+		return 1;
+	}
+	starts = sizes + opts->argc + 1;
+
+	/*
+	 * Note the size of each file once, and where it starts in the input
+	 * as a whole, so that the jobs cut from it below are the same as the
+	 * ones counted here.
+	 */
+	jobcount = 0;
+	total = 0;
+	for (i = 0; i < opts->argc; i++) {
+		if (fstat64(fds[i], &sb) == 0)
+			sizes[i] = sb.st_size;
+		starts[i] = total;
+		total += sizes[i];
+		if (!cached[i])
+			jobcount += 1 + (sizes[i] / SCAN_CHUNK_SIZE);
+	}
+
+	queue.jobs = calloc(jobcount + 1, sizeof(*(queue.jobs)));
+	if (queue.jobs == NULL) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(errno));
+		state->exit_status |= 64;
+		free(sizes);
+		return 1;
+	}
+
+	/*
+	 * The last job for each file carries on to the end of the file, in
+	 * case it has grown since we looked at its size above.
+	 */
+	for (i = 0, n = 0; i < opts->argc; i++) {
+		if (cached[i])
+			continue;
+		for (offset = 0;; offset += SCAN_CHUNK_SIZE) {
+			queue.jobs[n].file = i;
+			queue.jobs[n].fd = fds[i];
+			queue.jobs[n].offset = offset;
+			queue.jobs[n].length = SCAN_CHUNK_SIZE;
+			queue.jobs[n].start = starts[i] + offset;
+			queue.jobs[n].end = starts[i] + offset + SCAN_CHUNK_SIZE;
+			n++;
+			if (offset + SCAN_CHUNK_SIZE >= sizes[i]) {
+				queue.jobs[n - 1].length = 0;
+				queue.jobs[n - 1].end = starts[i] + sizes[i];
+				break;
+			}
+		}
+	}
+	queue.count = n;
+
+#ifdef PV_SCAN_THREADS
+	queue.bg = bg;
+	queue.floor = total;
+#endif
+
+	pv__scan_run(&queue);
+
+	if ((cancel != NULL) && (*cancel)) {
+		free(queue.jobs);
+		free(sizes);
+		return 1;
+	}
+
+	if (queue.next < queue.count) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(ENOMEM));
+		state->exit_status |= 64;
+		free(queue.jobs);
+		free(sizes);
+		return 1;
+	}
+
+	failed = 0;
+
+	for (n = 0; n < queue.count; n++) {
+		counts[queue.jobs[n].file] += queue.jobs[n].lines;
+		if (queue.jobs[n].error == 0)
+			continue;
+		failed = 1;
+		/* Only report the first error in each file. */
+		if ((n > 0) && (queue.jobs[n - 1].error != 0)
+		    && (queue.jobs[n - 1].file == queue.jobs[n].file))
+			continue;
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			opts->argv[queue.jobs[n].file],
+			strerror(queue.jobs[n].error));
+		state->exit_status |= 2;
+	}
+
+	free(queue.jobs);
+
+	state->size = 0;
+	for (i = 0; i < opts->argc; i++)
+		state->size += counts[i];
+
+#ifdef PV_SCAN_THREADS
+	/*
+	 * If the transfer overtook the count, everything before
+	 * queue.floor was left to the transfer, which has since written up
+	 * to "cursor_bytes", at or past queue.floor. The lines between the
+	 * two were counted by both, so they are counted again - from data
+	 * the transfer has just read, so it should still be in the page
+	 * cache - and taken off.
+	 */
+	if ((queue.overtaken) && (!failed)) {
+		pthread_mutex_lock(&(bg->lock));
+		cursor_bytes = bg->cursor_bytes;
+		cursor_lines = bg->cursor_lines;
+		pthread_mutex_unlock(&(bg->lock));
+
+		ahead = 0;
+		for (i = 0; i < opts->argc; i++) {
+			partial[i] = (starts[i] < queue.floor);
+			if (starts[i] + sizes[i] > queue.floor)
+				ahead += counts[i];
+		}
+
+		failed = pv__scan_range(opts, fds, sizes, starts, queue.floor,
+					cursor_bytes, &passed);
+		state->size = 0;
+		if ((!failed) && (cursor_lines + ahead >= passed))
+			state->size = cursor_lines + ahead - passed;
+	}
+#endif
+
+	free(sizes);
+
+	return failed;
+}
+
+
+/*
+ * Set state->size to the total number of lines in all of the input files,
+ * or to zero if any of them is not a regular file or can't be read.
+ *
+ * Files whose line count is in the cache (see cache.c) are not read at
+ * all. The rest are divided into jobs of SCAN_CHUNK_SIZE bytes, which are
+ * shared out between threads so that large files, and many files, are
+ * counted in parallel, and their counts are then added to the cache.
+ *
+ * If "bg" is not NULL, this is a background count racing the transfer,
+ * as described in pv__scan_files().
+ */
+static void pv__count_lines(pv_state_t state, struct pv__count_bg *bg)
+{
+	opts_t opts = state->opts;
+	unsigned long long *counts;
+	char *cached, *partial;
+	int *fds;
+	int i;
+
+	state->size = 0;
+
+	fds = malloc(opts->argc * sizeof(int));
+	counts = calloc(opts->argc, sizeof(*counts));
+	cached = calloc(2 * opts->argc, 1);
+	if ((fds == NULL) || (counts == NULL) || (cached == NULL)) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(errno));
+		state->exit_status |= 64;
+		if (fds)
+			free(fds);
+		if (counts)
+			free(counts);
+		if (cached)
+			free(cached);
+		return;
+	}
+	partial = cached + opts->argc;
+
+	for (i = 0; i < opts->argc; i++)
+		fds[i] = -1;
+
+	if (pv__scan_open(state, fds) == 0) {
+		for (i = 0; i < opts->argc; i++) {
+			if (pv_linecache_get(opts, fds[i], &(counts[i])) == 0)
+				cached[i] = 1;
+		}
+		if (pv__scan_files(state, fds, cached, counts, partial, bg)
+		    == 0) {
+			for (i = 0; i < opts->argc; i++) {
+				if ((!cached[i]) && (!partial[i]))
+					pv_linecache_put(opts, fds[i],
+							 counts[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < opts->argc; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	free(fds);
+	free(counts);
+	free(cached);
+}
+
+
+/*
+ * Estimate the number of lines in the "size" bytes of the file open on
+ * "fd" by counting the lines in evenly spaced samples of it, read into
+ * "buf", which must be ESTIMATE_SAMPLE_SIZE bytes long. The bytes and
+ * lines sampled are added to *sampled and *sampledlines.
+ *
+ * Samples are taken in rounds, each one doubling the number of evenly
+ * spaced points by sampling halfway between the previous ones, until the
+ * 95% confidence interval of the mean number of lines per byte is within
+ * ESTIMATE_PRECISION of the mean, or ESTIMATE_SAMPLES_MAX is reached.
+ * Files too small to be worth sampling are counted in full.
+ *
+ * Returns the estimated number of lines, or -1 on read error, with errno
+ * set.
+ */
+static long long pv__estimate_file(int fd, unsigned long long size,
+				   unsigned char delimiter, unsigned char *buf,
+				   unsigned long long *sampled,
+				   unsigned long long *sampledlines)
+{
+	unsigned long long offset, bytes, lines, count;
+	long double ratio, sum, sumsq, mean, variance;
+	int samples, k, i, step;
+	ssize_t got;
+
+	bytes = 0;
+	lines = 0;
+	sum = 0;
+	sumsq = 0;
+	samples = 0;
+
+	if (size <= (unsigned long long) ESTIMATE_SAMPLE_SIZE
+	    * ESTIMATE_SAMPLES_MIN) {
+		offset = 0;
+		while (1) {
+			got = pread64(fd, buf, ESTIMATE_SAMPLE_SIZE, offset);
+			if ((got < 0) && (errno == EINTR))
+				continue;
+			if (got < 0)
+				return -1;
+			if (got == 0)
+				break;
+			lines += pv_memcount(buf, got, delimiter);
+			offset += got;
+		}
+		*sampled += offset;
+		*sampledlines += lines;
+		return lines;
+	}
+
+	for (k = ESTIMATE_SAMPLES_MIN; k <= ESTIMATE_SAMPLES_MAX; k *= 2) {
+		i = (k == ESTIMATE_SAMPLES_MIN) ? 0 : 1;
+		step = (k == ESTIMATE_SAMPLES_MIN) ? 1 : 2;
+		for (; i < k; i += step) {
+			offset = (unsigned long long)
+			    ((long double) (size - ESTIMATE_SAMPLE_SIZE) * i
+			     / k);
+			got = pread64(fd, buf, ESTIMATE_SAMPLE_SIZE, offset);
+			if ((got < 0) && (errno == EINTR)) {
+				i -= step;
+				continue;
+			}
+			if (got < 0)
+				return -1;
+			if (got == 0)
+				continue;
+			count = pv_memcount(buf, got, delimiter);
+			ratio = (long double) count / (long double) got;
+			sum += ratio;
+			sumsq += ratio * ratio;
+			samples++;
+			bytes += got;
+			lines += count;
+		}
+
+		if ((samples < 2) || (sum <= 0))
+			continue;
+
+		/*
+		 * Stop once 1.96 standard errors is within the required
+		 * precision, comparing squares to avoid needing sqrt().
+		 */
+		mean = sum / samples;
+		variance = (sumsq - samples * mean * mean) / (samples - 1);
+		if (variance < 0)
+			variance = 0;
+		if (1.96 * 1.96 * variance / samples <=
+		    ESTIMATE_PRECISION * ESTIMATE_PRECISION * mean * mean)
+			break;
+	}
+
+	*sampled += bytes;
+	*sampledlines += lines;
+
+	if (bytes < 1)
+		return 0;
+
+	return (long long) ((long double) size * lines / bytes);
+}
+
+
+/*
+ * Set state->size to an estimate of the total number of lines in all of the
+ * input files, made by sampling them with pv__estimate_file(), or to zero
+ * if any of them is not a regular file or can't be read.
+ *
+ * The total number of bytes, and the bytes and lines sampled, are kept in
+ * the state so that the estimate can be refined as the transfer goes on.
+ */
+static void pv__estimate_lines(pv_state_t state)
+{
+	opts_t opts = state->opts;
+	unsigned long long sampled, sampledlines, total, cached;
+	unsigned char *buf;
+	struct stat64 sb;
+	long long lines;
+	int *fds;
+	int i;
+
+	state->size = 0;
+	state->estimate_bytes = 0;
+
+	fds = malloc(opts->argc * sizeof(int));
+	buf = malloc(ESTIMATE_SAMPLE_SIZE);
+	if ((fds == NULL) || (buf == NULL)) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("buffer allocation failed"), strerror(errno));
+		state->exit_status |= 64;
+		if (fds)
+			free(fds);
+		if (buf)
+			free(buf);
+		return;
+	}
+
+	for (i = 0; i < opts->argc; i++)
+		fds[i] = -1;
+
+	sampled = 0;
+	sampledlines = 0;
+	total = 0;
+	lines = 0;
+
+	if (pv__scan_open(state, fds) == 0) {
+		for (i = 0; (i < opts->argc) && (lines >= 0); i++) {
+			if (fstat64(fds[i], &sb) != 0)
+				sb.st_size = 0;
+			/*
+			 * A cached count is as good as sampling all of the
+			 * file.
+			 */
+			if (pv_linecache_get(opts, fds[i], &cached) == 0) {
+				lines = cached;
+				sampled += sb.st_size;
+				sampledlines += cached;
+			} else {
+				lines =
+				    pv__estimate_file(fds[i], sb.st_size,
+						      opts->delimiter, buf,
+						      &sampled, &sampledlines);
+			}
+			if (lines < 0) {
+				fprintf(stderr, "%s: %s: %s\n",
+					opts->program_name, opts->argv[i],
+					strerror(errno));
+				state->exit_status |= 2;
+				state->size = 0;
+				break;
+			}
+			state->size += lines;
+			total += sb.st_size;
+		}
+		if (lines >= 0) {
+			state->estimate_bytes = total;
+			state->sample_bytes = sampled;
+			state->sample_lines = sampledlines;
+		}
+	}
+
+	for (i = 0; i < opts->argc; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	free(fds);
+	free(buf);
+}
+
+
 /*
  * Try to work out the total size of all data by adding up the sizes of all
- * input files. If any of the input files are of indeterminate size (i.e.
- * they are a pipe), the total size is set to zero.
+ * input files, and put it in state->size. If any of the input files are of
+ * indeterminate size (i.e. they are a pipe), the total size is set to zero.
  *
  * Any files that cannot be stat()ed or that access() says we can't read
  * will cause a warning to be output and will be removed from the list.
  *
  * In line mode, any files that pass the above checks will then be read to
  * determine how many lines they contain, and the total size will be set to
- * the total line count. Only regular files will be read.
+ * the total line count. Only regular files will be read, and they are read
+ * by several threads at once where possible (see pv__count_lines()), or
+ * just sampled if opts->estimate is set (see pv__estimate_lines()). If
+ * there is a lot to read, state->size is left at zero and
+ * state->count_later is set instead, and the count is done in the
+ * background during the transfer (see pv_count_start()).
  */
-void pv_calc_total_size(opts_t opts)
+void pv_calc_total_size(pv_state_t state)
 {
+	opts_t opts = state->opts;
 	struct stat64 sb;
 	int rc, i, j, fd;
 
-	opts->size = 0;
+	state->size = 0;
 	rc = 0;
 
 	if (opts->argc < 1) {
 		if (fstat64(STDIN_FILENO, &sb) == 0)
-			opts->size = sb.st_size;
+			state->size = sb.st_size;
 		return;
 	}
 
@@ -53,7 +822,7 @@ void pv_calc_total_size(opts_t opts)
 		if (strcmp(opts->argv[i], "-") == 0) {
 			rc = fstat64(STDIN_FILENO, &sb);
 			if (rc != 0) {
-				opts->size = 0;
+				state->size = 0;
 				return;
 			}
 		} else {
@@ -70,7 +839,7 @@ void pv_calc_total_size(opts_t opts)
 			}
 			opts->argc--;
 			i--;
-			opts->exit_status |= 2;
+			state->exit_status |= 2;
 			continue;
 		}
 
@@ -85,77 +854,148 @@ void pv_calc_total_size(opts_t opts)
 				fd = open64(opts->argv[i], O_RDONLY);
 			}
 			if (fd >= 0) {
-				opts->size += lseek64(fd, 0, SEEK_END);
+				state->size += lseek64(fd, 0, SEEK_END);
 				close(fd);
 			} else {
 				fprintf(stderr, "%s: %s: %s\n",
 					opts->program_name, opts->argv[i],
 					strerror(errno));
-				opts->exit_status |= 2;
+				state->exit_status |= 2;
 			}
 		} else if (S_ISREG(sb.st_mode)) {
-			opts->size += sb.st_size;
+			state->size += sb.st_size;
 		} else {
-			opts->size = 0;
+			state->size = 0;
 		}
 	}
 
 	if (!opts->linemode)
 		return;
 
-	opts->size = 0;
+	state->size_bytes = state->size;
 
-	for (i = 0; i < opts->argc; i++) {
-		fd = -1;
+	if (opts->estimate) {
+		pv__estimate_lines(state);
+		return;
+	}
 
-		if (strcmp(opts->argv[i], "-") == 0) {
-			rc = fstat64(STDIN_FILENO, &sb);
-			if ((rc != 0) || (!S_ISREG(sb.st_mode))) {
-				opts->size = 0;
-				return;
-			}
-			fd = dup(STDIN_FILENO);
-		} else {
-			rc = stat64(opts->argv[i], &sb);
-			if ((rc != 0) || (!S_ISREG(sb.st_mode))) {
-				opts->size = 0;
-				return;
-			}
-			fd = open64(opts->argv[i], O_RDONLY);
-		}
+#ifdef PV_SCAN_THREADS
+	/*
+	 * If there is more to count than one counting job's worth, leave it
+	 * to pv_count_start() to do in the background, so that the transfer
+	 * doesn't have to wait for it.
+	 */
+	if ((state->size > SCAN_CHUNK_SIZE) && (opts->argc > 0)) {
+		state->size = 0;
+		state->count_later = 1;
+		return;
+	}
+#endif
 
-		if (fd < 0) {
-			fprintf(stderr, "%s: %s: %s\n", opts->program_name,
-				opts->argv[i], strerror(errno));
-			opts->size = 0;
-			opts->exit_status |= 2;
+	pv__count_lines(state, NULL);
+}
+
+
+#ifdef PV_SCAN_THREADS
+/*
+ * Count the lines for the given background count, marking it as done
+ * unless it was cancelled.
+ */
+static void *pv__count_bg_run(void *arg)
+{
+	struct pv__count_bg *bg = arg;
+
+	pv__count_lines(&(bg->state), bg);
+
+	pthread_mutex_lock(&(bg->lock));
+	if (!bg->cancel)
+		bg->done = 1;
+	pthread_mutex_unlock(&(bg->lock));
+
+	return arg;
+}
+#endif				/* PV_SCAN_THREADS */
+
+
+/*
+ * Start counting the lines of the input files in the background, if
+ * pv_calc_total_size() left that until later, so that pv_count_poll() can
+ * fill in state->size once the count is done. The count starts from the
+ * end of the input and stops where it meets the transfer, so that nothing
+ * is read twice (see pv__scan_files()). If the thread can't be started,
+ * the lines are counted straight away instead.
+ */
+void pv_count_start(pv_state_t state)
+{
+#ifdef PV_SCAN_THREADS
+	struct pv__count_bg *bg;
+#endif
+
+	if ((!state->count_later) || (state->count != NULL))
+		return;
+
+#ifdef PV_SCAN_THREADS
+	bg = calloc(1, sizeof(*bg));
+	if (bg != NULL) {
+		bg->opts = *(state->opts);
+		bg->state.opts = &(bg->opts);
+		pthread_mutex_init(&(bg->lock), NULL);
+		if (pthread_create(&(bg->thread), NULL, pv__count_bg_run, bg)
+		    == 0) {
+			state->count = bg;
 			return;
 		}
+		pthread_mutex_destroy(&(bg->lock));
+		free(bg);
+	}
+#endif
 
-		while (1) {
-			unsigned char scanbuf[1024];	/* RATS: ignore (OK) */
-			int numread, i;
+	state->count_later = 0;
+	pv__count_lines(state, NULL);
+}
 
-			numread = read(fd, /* RATS: ignore (OK) */ scanbuf,
-				       sizeof(scanbuf));
-			if (numread < 0) {
-				fprintf(stderr, "%s: %s: %s\n",
-					opts->program_name, opts->argv[i],
-					strerror(errno));
-				opts->exit_status |= 2;
-				break;
-			} else if (numread == 0) {
-				break;
-			}
-			for (i = 0; i < numread; i++) {
-				if (scanbuf[i] == '\n')
-					opts->size++;
-			}
-		}
 
-		lseek64(fd, 0, SEEK_SET);
-		close(fd);
+/*
+ * Tell the background line count started by pv_count_start() how far the
+ * transfer has got, and check whether it has finished, and if so, set
+ * state->size to the result. If "stop" is nonzero, the count is cancelled
+ * if it hasn't finished yet - and if the transfer has reached the end,
+ * the lines it has written are the total.
+ */
+void pv_count_poll(pv_state_t state, int stop)
+{
+#ifdef PV_SCAN_THREADS
+	struct pv__count_bg *bg = state->count;
+	int done;
+
+	if (bg == NULL)
+		return;
+
+	pthread_mutex_lock(&(bg->lock));
+	bg->cursor_bytes = state->loop.bytes_total;
+	bg->cursor_lines = state->loop.total_written;
+	done = bg->done;
+	if ((stop) && (!done))
+		bg->cancel = 1;
+	pthread_mutex_unlock(&(bg->lock));
+
+	if ((!done) && (!stop))
+		return;
+
+	pthread_join(bg->thread, NULL);
+	pthread_mutex_destroy(&(bg->lock));
+
+	if (done) {
+		state->size = bg->state.size;
+	} else if (state->loop.eof_in && state->loop.eof_out) {
+		state->size = state->loop.total_written;
 	}
+	state->exit_status |= bg->state.exit_status;
+	state->count_later = 0;
+
+	free(bg);
+	state->count = NULL;
+#endif				/* PV_SCAN_THREADS */
 }
 
 
@@ -163,10 +1003,11 @@ void pv_calc_total_size(opts_t opts)
  * Close the given file descriptor and open the next one, whose number in
  * the list is "filenum", returning the new file descriptor (or negative on
  * error). It is an error if the next input file is the same as the file
- * stdout is pointing to.
+ * "outfd", the output, is pointing to.
  */
-int pv_next_file(opts_t opts, int filenum, int oldfd)
+int pv_next_file(pv_state_t state, int filenum, int oldfd, int outfd)
 {
+	opts_t opts = state->opts;
 	struct stat64 isb;
 	struct stat64 osb;
 	int fd;
@@ -177,31 +1018,33 @@ int pv_next_file(opts_t opts, int filenum, int oldfd)
 				opts->program_name,
 				_("failed to close file"),
 				strerror(errno));
-			opts->exit_status |= 8;
+			state->exit_status |= 8;
 			return -1;
 		}
 	}
 
 	if (filenum >= opts->argc) {
-		opts->exit_status |= 8;
+		state->exit_status |= 8;
 		return -1;
 	}
 
 	if (filenum < 0) {
-		opts->exit_status |= 8;
+		state->exit_status |= 8;
 		return -1;
 	}
 
 	if (strcmp(opts->argv[filenum], "-") == 0) {
 		fd = STDIN_FILENO;
+		state->current_file = "(stdin)";
 	} else {
+		state->current_file = opts->argv[filenum];
 		fd = open64(opts->argv[filenum], O_RDONLY);
 		if (fd < 0) {
 			fprintf(stderr, "%s: %s: %s: %s\n",
 				opts->program_name,
 				_("failed to read file"),
 				opts->argv[filenum], strerror(errno));
-			opts->exit_status |= 2;
+			state->exit_status |= 2;
 			return -1;
 		}
 	}
@@ -212,21 +1055,21 @@ int pv_next_file(opts_t opts, int filenum, int oldfd)
 			_("failed to stat file"),
 			opts->argv[filenum], strerror(errno));
 		close(fd);
-		opts->exit_status |= 2;
+		state->exit_status |= 2;
 		return -1;
 	}
 
-	if (fstat64(STDOUT_FILENO, &osb)) {
+	if (fstat64(outfd, &osb)) {
 		fprintf(stderr, "%s: %s: %s\n",
 			opts->program_name,
 			_("failed to stat output file"), strerror(errno));
 		close(fd);
-		opts->exit_status |= 2;
+		state->exit_status |= 2;
 		return -1;
 	}
 
 	/*
-	 * Check that this new input file is not the same as stdout's
+	 * Check that this new input file is not the same as the output's
 	 * destination. This restriction is ignored for anything other
 	 * than a regular file or block device.
 	 */
@@ -243,7 +1086,7 @@ int pv_next_file(opts_t opts, int filenum, int oldfd)
 		opts->program_name,
 		_("input file is output file"), opts->argv[filenum]);
 	close(fd);
-	opts->exit_status |= 4;
+	state->exit_status |= 4;
 	return -1;
 }
 
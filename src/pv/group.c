@@ -0,0 +1,363 @@
+/*
+ * Rate group functions, letting several instances of `pv' share a single
+ * rate limit (--rate-group and --group-limit).
+ *
+ * If IPC is available, each group's token bucket is kept in a shared
+ * memory segment, keyed on a per-user lockfile named after the group in
+ * ${TMPDIR:-${TMP:-/tmp}}, which is also locked while the bucket is being
+ * updated. Members reserve the bandwidth for what they are about to write
+ * before writing it, at most their fair share of the group's burst size
+ * at a time, and the reservations are queued one after another, so that
+ * busy members take it in turns while idle members, reserving nothing,
+ * leave the whole rate to the others.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_IPC
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+# ifdef HAVE_SYS_PARAM_H
+# include <sys/param.h>
+# endif
+#endif				/* HAVE_IPC */
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+
+#ifdef HAVE_IPC
+/*
+ * The token bucket shared between the members of a rate group, kept as
+ * the time from which the bytes reserved so far will all have been paid
+ * for, rather than as a count of tokens, so that reservations queue up
+ * one behind another.
+ */
+struct pv__group_bucket {
+	long long next_free;		 /* nsec time next reservation starts */
+	unsigned long long limit;	 /* group rate limit, bytes/sec */
+	unsigned long long size;	 /* most bytes that may go at once */
+};
+
+
+/*
+ * Lock or unlock (if "type" is F_UNLCK) the group's lockfile.
+ */
+static void pv__group_lock(struct pv_group_state *grp, int type)
+{
+	struct flock lock;
+
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	while ((fcntl(grp->lock_fd, F_SETLKW, &lock) < 0)
+	       && (errno == EINTR)) {
+		/* try again */ ;
+	}
+}
+
+
+/*
+ * Return the number of group members attached to the shared bucket,
+ * including us.
+ */
+static int pv__group_members(struct pv_group_state *grp)
+{
+	struct shmid_ds buf;
+
+	buf.shm_nattch = 0;
+	shmctl(grp->shmid, IPC_STAT, &buf);
+	if (buf.shm_nattch < 1)
+		return 1;
+
+	return buf.shm_nattch;
+}
+
+
+/*
+ * Reserve the group's bandwidth for up to "pending" bytes, but no more
+ * than our share of the burst size, starting as soon after the time "now"
+ * as the reservations already made by the other members allow. A member
+ * that has been idle can go straight away, up to the burst size.
+ */
+static void pv__group_reserve(struct pv_group_state *grp, long long now,
+			      unsigned long long pending)
+{
+	struct pv__group_bucket *bucket = grp->bucket;
+	unsigned long long amount;
+	long long earliest;
+
+	pv__group_lock(grp, F_WRLCK);
+
+	if (bucket->limit == 0) {
+		pv__group_lock(grp, F_UNLCK);
+		return;
+	}
+
+	amount = bucket->size / pv__group_members(grp);
+	if (amount < 1)
+		amount = 1;
+	if (amount > pending)
+		amount = pending;
+
+	earliest = now - (long long) (((long double) (bucket->size))
+				      * 1000000000.0 /
+				      (long double) (bucket->limit));
+	if (bucket->next_free < earliest)
+		bucket->next_free = earliest;
+
+	grp->reserved = amount;
+	grp->reserved_at = bucket->next_free;
+
+	bucket->next_free += (long long) (((long double) amount)
+					  * 1000000000.0 /
+					  (long double) (bucket->limit));
+	grp->reserved_end = bucket->next_free;
+
+	pv__group_lock(grp, F_UNLCK);
+}
+#endif				/* HAVE_IPC */
+
+
+/*
+ * Join the rate group opts->rate_group, creating it if we are the first
+ * member, and if opts->group_limit is nonzero, set the group's limit to
+ * that.
+ *
+ * Returns nonzero on error.
+ */
+int pv_group_init(pv_state_t state)
+{
+#ifdef HAVE_IPC
+	struct pv_group_state *grp = &(state->group);
+	struct pv__group_bucket *bucket;
+	opts_t opts = state->opts;
+	char *tmpdir;
+	char *lockfile;
+	void *shm;
+	key_t key;
+
+	if (opts->rate_group == NULL)
+		return 0;
+
+	if ((opts->rate_group[0] == 0)
+	    || (strchr(opts->rate_group, '/') != NULL)) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("invalid rate group name"), opts->rate_group);
+		state->exit_status |= 2;
+		return 1;
+	}
+
+	tmpdir = (char *) getenv("TMPDIR"); /* RATS: ignore */
+	if (!tmpdir)
+		tmpdir = (char *) getenv("TMP");	/* RATS: ignore */
+	if (!tmpdir)
+		tmpdir = "/tmp";
+
+	lockfile = malloc(strlen(tmpdir)	/* RATS: ignore */
+			  + strlen(opts->rate_group) + 64);	/* RATS: ignore */
+	if (lockfile == NULL) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("rate group allocation failed"), strerror(errno));
+		state->exit_status |= 64;
+		return 1;
+	}
+	sprintf(lockfile, "%s/pv-group-%i-%s.lock",	/* RATS: ignore */
+		tmpdir, geteuid(), opts->rate_group);
+
+	grp->lock_fd = open(lockfile, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	key = (grp->lock_fd < 0) ? -1 : ftok(lockfile, 'g');
+	free(lockfile);
+
+	if (key == -1) {
+		fprintf(stderr, "%s: %s: %s: %s\n",
+			opts->program_name,
+			_("failed to open rate group"),
+			opts->rate_group, strerror(errno));
+		state->exit_status |= 2;
+		return 1;
+	}
+
+	/*
+	 * Hold the lock while attaching, so that if nobody else is attached
+	 * we can set up the bucket before any other member uses it.
+	 */
+	pv__group_lock(grp, F_WRLCK);
+
+	grp->shmid = shmget(key, sizeof(*bucket), 0600 | IPC_CREAT);
+	shm = (grp->shmid < 0) ? (void *) -1 : shmat(grp->shmid, 0, 0);
+	if (shm == (void *) -1) {
+		fprintf(stderr, "%s: %s: %s: %s\n",
+			opts->program_name,
+			_("failed to open rate group"),
+			opts->rate_group, strerror(errno));
+		state->exit_status |= 2;
+		pv__group_lock(grp, F_UNLCK);
+		return 1;
+	}
+	grp->bucket = shm;
+	bucket = grp->bucket;
+
+	if (pv__group_members(grp) < 2)
+		memset(bucket, 0, sizeof(*bucket));
+
+	if (opts->group_limit > 0) {
+		bucket->limit = opts->group_limit;
+		bucket->size = opts->burst;
+		if (bucket->size < 1)
+			bucket->size = opts->group_limit / 100;
+		if (bucket->size < 1)
+			bucket->size = 1;
+	}
+
+	pv__group_lock(grp, F_UNLCK);
+#else				/* !HAVE_IPC */
+	opts_t opts = state->opts;
+
+	if (opts->rate_group != NULL) {
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("rate groups are not supported on this system"));
+		state->exit_status |= 2;
+		return 1;
+	}
+#endif				/* HAVE_IPC */
+
+	return 0;
+}
+
+
+/*
+ * Return the number of nanoseconds from the time "now" until we may start
+ * writing the "pending" bytes waiting in the buffer, or as many of them
+ * as the group lets us send at once, reserving the bandwidth for them if
+ * we haven't already; or return 0 if we can write now (or there is
+ * nothing to write, or we are not in a group, or it has no limit).
+ */
+long long pv_group_wait(pv_state_t state, long long now,
+			unsigned long long pending)
+{
+#ifdef HAVE_IPC
+	struct pv_group_state *grp = &(state->group);
+
+	if ((grp->bucket == NULL) || (pending == 0))
+		return 0;
+
+	if (grp->reserved == 0)
+		pv__group_reserve(grp, now, pending);
+
+	if ((grp->reserved == 0) || (grp->reserved_at <= now))
+		return 0;
+
+	return grp->reserved_at - now;
+#else				/* !HAVE_IPC */
+	return 0;
+#endif				/* HAVE_IPC */
+}
+
+
+/*
+ * Return how many of "want" bytes the group allows us to write at the time
+ * "now", given that "pending" bytes are waiting in the buffer, reserving
+ * the bandwidth with pv_group_wait() if we need to. The number actually
+ * written must then be passed to pv_group_used().
+ */
+unsigned long long pv_group_allow(pv_state_t state, long long now,
+				  unsigned long long want,
+				  unsigned long long pending)
+{
+#ifdef HAVE_IPC
+	struct pv_group_state *grp = &(state->group);
+
+	if (grp->bucket == NULL)
+		return want;
+
+	if ((pending == 0) || (pv_group_wait(state, now, pending) > 0))
+		return 0;
+
+	/*
+	 * No reservation was needed, because the group has no limit.
+	 */
+	if (grp->reserved == 0)
+		return want;
+
+	if (want > grp->reserved)
+		want = grp->reserved;
+#endif				/* HAVE_IPC */
+
+	return want;
+}
+
+
+/*
+ * Mark "used" bytes of our reservation as having been written.
+ */
+void pv_group_used(pv_state_t state, unsigned long long used)
+{
+	struct pv_group_state *grp = &(state->group);
+
+	if (used > grp->reserved)
+		used = grp->reserved;
+	grp->reserved -= used;
+}
+
+
+/*
+ * Leave the rate group, removing its shared memory if we are the last
+ * member.
+ */
+void pv_group_fini(pv_state_t state)
+{
+#ifdef HAVE_IPC
+	struct pv_group_state *grp = &(state->group);
+	struct pv__group_bucket *bucket = grp->bucket;
+
+	if (grp->lock_fd < 0)
+		return;
+
+	if (grp->bucket != NULL) {
+		pv__group_lock(grp, F_WRLCK);
+		/*
+		 * Hand back any of our reservation we didn't use, but only
+		 * if nobody has reserved after us; otherwise the unused
+		 * time is in the middle of the queue, and is left to expire.
+		 */
+		if ((grp->reserved > 0) && (bucket->limit > 0)
+		    && (bucket->next_free == grp->reserved_end)) {
+			bucket->next_free -=
+			    (long long) (((long double) (grp->reserved))
+					 * 1000000000.0 /
+					 (long double) (bucket->limit));
+			if (bucket->next_free < grp->reserved_at)
+				bucket->next_free = grp->reserved_at;
+		}
+		if (pv__group_members(grp) < 2)
+			shmctl(grp->shmid, IPC_RMID, 0);
+		shmdt(grp->bucket);
+		grp->bucket = NULL;
+	}
+
+	close(grp->lock_fd);
+	grp->lock_fd = -1;
+#endif				/* HAVE_IPC */
+}
+
+/* EOF */
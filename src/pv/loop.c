@@ -5,113 +5,617 @@
  * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
  */
 
-#include "options.h"
-#include "pv.h"
-
 #define _GNU_SOURCE 1
 #include <limits.h>
 
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
-#define RATE_GRANULARITY	100000	    /* usec between -L rate chunks */
+#define RATE_MAX_WAIT	90000000    /* most nsec to wait for -L tokens */
 
-extern struct timeval pv_sig_toffset;
+extern long long pv_sig_toffset;
 extern sig_atomic_t pv_sig_newsize;
 extern sig_atomic_t pv_sig_abort;
 
 
 /*
- * Add the given number of microseconds (which may be negative) to the given
- * timeval.
+ * Refine the estimated line count made by pv_calc_total_size() with
+ * --estimate-lines, treating the lines and bytes written so far as more
+ * samples alongside those the estimate was made from. Once all the input
+ * has been written, the count is exact.
  */
-static void pv_timeval_add_usec(struct timeval *val, long usec)
+static void pv__refine_estimate(pv_state_t state)
 {
-	val->tv_usec += usec;
-	while (val->tv_usec < 0) {
-		val->tv_sec--;
-		val->tv_usec += 1000000;
+	struct pv_loop_state *l = &(state->loop);
+	long double ratio;
+
+	if (state->estimate_bytes < 1)
+		return;
+
+	if ((l->eof_in && l->eof_out)
+	    || (l->bytes_total >= state->estimate_bytes)) {
+		state->size = l->total_written;
+		return;
 	}
-	while (val->tv_usec >= 1000000) {
-		val->tv_sec++;
-		val->tv_usec -= 1000000;
+
+	ratio = (long double) (state->sample_lines + l->total_written);
+	ratio /= (long double) (state->sample_bytes + l->bytes_total);
+
+	state->size = l->total_written
+	    + (unsigned long long) (ratio *
+				    (state->estimate_bytes - l->bytes_total));
+}
+
+
+/*
+ * Add the number of lines in the input file that has just been finished
+ * to the line count cache (see cache.c), if all of it was read, and note
+ * where the next file starts.
+ */
+static void pv__cache_lines(pv_state_t state)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	struct stat64 sb;
+
+	if ((opts->linemode) && (state->transfer.bad_sectors == 0)
+	    && (l->fd >= 0) && (fstat64(l->fd, &sb) == 0)
+	    && (S_ISREG(sb.st_mode))
+	    && (l->bytes_total - l->file_bytes
+		== (unsigned long long) (sb.st_size))) {
+		pv_linecache_put(opts, l->fd,
+				 l->total_written - l->file_lines);
 	}
+
+	l->file_bytes = l->bytes_total;
+	l->file_lines = l->total_written;
 }
 
 
-/* TODO: FIXME: Henry Precheur writes:
- * 
- * pv has a bug with --rate-limit:
- * 
- * pv blocks with a rate-limit between 1 and 9.
- * 
- * $ pv --rate-limit 1 < /dev/zero
- * 0B 0:00:11 [   0B/s ] [<=>                         ]
- * 
- * It looks like pv is sending bytes to stdout every 1/10th seconds, and
- * the `target` variable contains the number of bytes to transfert each
- * time.
- * 
- * The `target` rate is calculated in pv/loop.c line 81:
- * 
- * >  target =
- * >       ((long double) (opts->rate_limit)) /
- * >                       (long double) (1000000 / RATE_GRANULARITY);
- * 
- * Which is equivalent to:
- * 
- * > target = rate_limit / 10
- * 
- * `target` is an int, so if rate limit is below 10 target equals 0, and pv
- * blocks.
- * 
- * I would recommend to change the algorithm limiting the rate transfert to
- * something like this:
- * 
- *   target = rate_limit / 10;
- * 
- *   iteration_counter = 0;
- * 
- *   while (1)
- *   {
- *     write_to_stdout(target);
- *     iteration_counter++;
- * 
- *     
- *     // Flush the remaining bytes
- *     if (iteration_counter % 10)
- *     {
- *       write_to_stdout(rate_limit - target * 10);
- *     }
- *   }
+/*
+ * Return the number of bytes left to transfer, or 0 if we don't know. In
+ * line mode where only the number of lines is known, this is estimated
+ * from the average line length so far.
  */
+static unsigned long long pv__deadline_remaining(pv_state_t state)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	unsigned long long written;
+	long double per_line;
+
+	written = (unsigned long long) (l->total_written);
+
+	if (!opts->linemode) {
+		if (state->size <= written)
+			return 0;
+		return state->size - written;
+	}
+
+	if (state->size_bytes > 0) {
+		if (state->size_bytes <= l->bytes_total)
+			return 0;
+		return state->size_bytes - l->bytes_total;
+	}
+
+	if ((state->size <= written) || (written < 1))
+		return 0;
+
+	per_line = ((long double) (l->bytes_total)) / written;
+
+	return (unsigned long long) (per_line * (state->size - written));
+}
 
 
 /*
- * Pipe data from a list of files to standard output, giving information
- * about the transfer on standard error according to the given options.
+ * Once per update interval, work out the rate needed to get through what
+ * is left by the --finish-by deadline, and note the fastest rate we have
+ * actually managed so far. If the deadline can no longer be met - it has
+ * passed, or the rate needed is above the -L limit, or above anything we
+ * have managed while going as fast as we were allowed to - warn about it,
+ * once, and with --strict-deadline, set 128 in the exit status.
+ */
+static void pv__deadline_update(pv_state_t state, long long now)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	unsigned long long done, remaining;
+	long double elapsed, achieved, left, aim;
+	int bottleneck, missed;
+
+	if ((l->deadline_checked > 0)
+	    && ((now - l->deadline_checked) <
+		(long long) (opts->interval * 1000000000.0)))
+		return;
+
+	done = opts->linemode ? l->bytes_total
+	    : (unsigned long long) (l->total_written);
+	bottleneck = 0;
+
+	if (l->deadline_checked > 0) {
+		elapsed = ((long double) (now - l->deadline_checked))
+		    / 1000000000.0;
+		achieved = ((long double) (done - l->deadline_done))
+		    / elapsed;
+		if (achieved > l->peak_rate)
+			l->peak_rate = achieved;
+		/*
+		 * If we didn't get near the rate we asked for, something
+		 * else is holding us back, so the peak is as fast as we go.
+		 */
+		if ((l->deadline_rate <= 0)
+		    || (achieved < l->deadline_rate * 0.9))
+			bottleneck = 1;
+	}
+
+	l->deadline_checked = now;
+	l->deadline_done = done;
+
+	remaining = pv__deadline_remaining(state);
+	left = ((long double) (l->deadline - now)) / 1000000000.0;
+	missed = 0;
+
+	/*
+	 * Aim to finish a little early, a hundredth of the way before the
+	 * deadline, since pacing tends to lag slightly behind the rate.
+	 */
+	aim = left - ((long double) (l->deadline - l->rate_start))
+	    / 100000000000.0;
+
+	if (remaining == 0) {
+		l->deadline_rate = 0;
+	} else if (left <= 0) {
+		l->deadline_rate = 0;
+		missed = 1;
+	} else {
+		if (aim <= 0)
+			aim = left;
+		l->deadline_rate = ((long double) remaining) / aim;
+		if (l->deadline_rate < 1)
+			l->deadline_rate = 1;
+		if ((opts->rate_limit > 0)
+		    && (l->deadline_rate > opts->rate_limit))
+			missed = 1;
+		if (bottleneck && (l->peak_rate > 0)
+		    && (l->deadline_rate > l->peak_rate))
+			missed = 1;
+	}
+
+	if (missed && (!l->deadline_missed)) {
+		l->deadline_missed = 1;
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("warning: the --finish-by deadline can no longer"
+			  " be met"));
+		if (opts->strict_deadline)
+			state->exit_status |= 128;
+	}
+}
+
+
+/*
+ * If the output is a TCP socket whose sending rate the kernel can limit
+ * (SO_MAX_PACING_RATE), set l->paced, so that the kernel can pace the
+ * packets evenly, leaving our own limiter as a coarse guard.
+ */
+static void pv__pacing_init(pv_state_t state)
+{
+	struct pv_loop_state *l = &(state->loop);
+#ifdef SO_MAX_PACING_RATE
+	struct sockaddr_storage addr;
+	socklen_t len;
+	unsigned int rate;
+	int type;
+#endif
+
+	l->paced = 0;
+	l->paced_rate = 0;
+
+#ifdef SO_MAX_PACING_RATE
+	len = sizeof(type);
+	if ((getsockopt(state->output_fd, SOL_SOCKET, SO_TYPE, &type, &len)
+	     != 0) || (type != SOCK_STREAM))
+		return;
+
+	len = sizeof(addr);
+	if (getsockname(state->output_fd, (struct sockaddr *) &addr, &len)
+	    != 0)
+		return;
+	if (addr.ss_family != AF_INET
+#ifdef AF_INET6
+	    && addr.ss_family != AF_INET6
+#endif
+	    )
+		return;
+
+	rate = ~0U;
+	if (setsockopt(state->output_fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+		       &rate, sizeof(rate)) != 0)
+		return;
+
+	l->paced = 1;
+#endif				/* SO_MAX_PACING_RATE */
+}
+
+
+/*
+ * Give the kernel the current rate limit to pace the output socket to, or
+ * no limit if "rate" is 0, if it has changed by more than 1% since it was
+ * last set, so that a ramp doesn't mean a system call every time round.
+ */
+static void pv__pacing_set(pv_state_t state, long double rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	struct pv_loop_state *l = &(state->loop);
+	unsigned int value;
+
+	if (!l->paced)
+		return;
+
+	if ((rate > 0) && (l->paced_rate > 0)
+	    && (rate > l->paced_rate * 0.99) && (rate < l->paced_rate * 1.01))
+		return;
+	if ((rate <= 0) && (l->paced_rate <= 0))
+		return;
+
+	value = ~0U;
+	if ((rate > 0) && (rate < (long double) (~0U)))
+		value = (unsigned int) rate;
+
+	setsockopt(state->output_fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+		   &value, sizeof(value));
+	l->paced_rate = rate;
+#endif				/* SO_MAX_PACING_RATE */
+}
+
+
+/*
+ * Work out the -L rate limit to use at the time "now": look up the rate
+ * the schedule gives, if there is one (but only once a minute, since it
+ * can't change more often than that), and while ramping up, scale the
+ * rate by how far through the ramp we are. With a --finish-by deadline,
+ * go no faster than is needed to meet it, and with --adaptive-limit, no
+ * faster than the system's I/O pressure allows (see adaptive.c). If the
+ * kernel is pacing the output, pass the result on to it.
+ */
+static void pv__rate_update(pv_state_t state, long long now)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	long double fraction;
+	time_t wall, until;
+
+	if ((opts->rate_schedule != NULL) && (now >= l->schedule_next)) {
+		wall = time(NULL);
+		opts->rate_limit =
+		    pv_schedule_rate(opts->rate_schedule, wall, &until);
+		l->schedule_next =
+		    now + ((long long) (until - wall)) * 1000000000LL;
+	}
+
+	l->rate = (long double) (opts->rate_limit);
+
+	if ((opts->ramp > 0) && (l->rate > 0)) {
+		fraction = ((long double) (now - l->rate_start))
+		    / (opts->ramp * 1000000000.0);
+		if (fraction < 1)
+			l->rate *= fraction;
+		if (l->rate < 1)
+			l->rate = 1;
+	}
+
+	if (l->deadline > 0) {
+		pv__deadline_update(state, now);
+		if ((l->deadline_rate > 0)
+		    && ((l->rate <= 0) || (l->deadline_rate < l->rate)))
+			l->rate = l->deadline_rate;
+	}
+
+	if (opts->adaptive_limit > 0) {
+		pv_adaptive_update(state, now);
+		if ((state->adaptive.rate > 0)
+		    && ((l->rate <= 0) || (state->adaptive.rate < l->rate)))
+			l->rate = state->adaptive.rate;
+	}
+
+	if (l->paced)
+		pv__pacing_set(state, l->rate);
+}
+
+
+/*
+ * Set up the --finish-by deadline, if there is one, as a time on the same
+ * clock as "now", warning and ignoring it if the size of the input is not
+ * known.
+ */
+static void pv__deadline_init(pv_state_t state, long long now)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	time_t wall, deadline;
+
+	l->deadline = 0;
+	l->deadline_checked = 0;
+	l->deadline_done = 0;
+	l->deadline_rate = 0;
+	l->peak_rate = 0;
+	l->deadline_missed = 0;
+
+	if (opts->finish_by == NULL)
+		return;
+
+	if ((state->size < 1) && (!state->count_later)) {
+		fprintf(stderr, "%s: %s\n", opts->program_name,
+			_("warning: --finish-by ignored, as the size"
+			  " is not known (try -s)"));
+		return;
+	}
+
+	wall = time(NULL);
+	if (pv_deadline_parse(opts->finish_by, wall, &deadline))
+		return;
+
+	l->deadline = now + ((long long) (deadline - wall)) * 1000000000LL;
+	if (l->deadline < 1)
+		l->deadline = 1;
+}
+
+
+/*
+ * Return nonzero if the transfer is limited in any way, by -L (including
+ * a schedule or deadline), a line rate limit, or a rate group.
+ */
+static int pv__limited(pv_state_t state)
+{
+	return ((state->loop.rate > 0) || (state->opts->line_rate_limit > 0)
+		|| (state->opts->rate_group != NULL));
+}
+
+
+/*
+ * Return the most tokens that a rate limit bucket filling at "rate" per
+ * second can hold: opts->burst if it was given, otherwise a hundredth of
+ * a second's worth - or if "coarse" is set, because the kernel is pacing
+ * the output for us, a tenth - but never less than one, so that low rates
+ * still get through.
+ */
+static long double pv__bucket_size(opts_t opts, long double rate,
+				   int coarse)
+{
+	long double size;
+
+	size = (long double) (opts->burst);
+	if (size < 1)
+		size = rate / (coarse ? 10.0 : 100.0);
+	if (size < 1)
+		size = 1;
+
+	return size;
+}
+
+
+/*
+ * Top up the rate limit buckets with the tokens earned between the last
+ * refill and the time "now", keeping any fraction of a token for next
+ * time, but not letting either bucket hold more than its size.
+ */
+static void pv__bucket_refill(pv_state_t state, long long now)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	long double elapsed, size;
+
+	elapsed = ((long double) (now - l->bucket_time)) / 1000000000.0;
+	if (elapsed < 0)
+		elapsed = 0;
+	l->bucket_time = now;
+
+	if (l->rate > 0) {
+		size = pv__bucket_size(opts, l->rate, l->paced);
+		l->tokens += elapsed * l->rate;
+		if (l->tokens > size)
+			l->tokens = size;
+	}
+
+	if (opts->line_rate_limit > 0) {
+		size = pv__bucket_size(opts, opts->line_rate_limit, 0);
+		l->line_tokens +=
+		    elapsed * (long double) (opts->line_rate_limit);
+		if (l->line_tokens > size)
+			l->line_tokens = size;
+	}
+}
+
+
+/*
+ * Return the number of nanoseconds from the time "now" until the rate
+ * limit buckets, including any rate group's (see group.c), will hold
+ * enough tokens to write what is waiting in the buffer - a full bucket's
+ * worth of bytes, or all of them if there are fewer, and at least one
+ * whole record - or 0 if there is nothing that waiting would help with.
+ */
+static long long pv__bucket_wait(pv_state_t state, long long now)
+{
+	struct pv_loop_state *l = &(state->loop);
+	struct pv_transfer_state *t = &(state->transfer);
+	opts_t opts = state->opts;
+	long double need, wait, line_wait;
+	unsigned long pending;
+	long long group_wait;
+
+	pending = t->in_buffer - t->bytes_written;
+	if ((l->eof_out) || (pending == 0))
+		return 0;
+
+	if ((opts->high_water > 0) && (t->prebuffering) && (!l->eof_in)
+	    && (pending < (t->bufsize * opts->high_water) / 100))
+		return 0;
+
+	wait = 0;
+
+	if (l->rate > 0) {
+		need = pv__bucket_size(opts, l->rate, l->paced);
+		if (need > pending)
+			need = pending;
+		if (l->tokens < need) {
+			wait = (need - l->tokens) / l->rate;
+		}
+	}
+
+	if ((opts->line_rate_limit > 0) && (l->line_tokens < 1)
+	    && (pv_transfer_records(state, 1, l->eof_in) > 0)) {
+		line_wait = (1 - l->line_tokens)
+		    / (long double) (opts->line_rate_limit);
+		if (line_wait > wait)
+			wait = line_wait;
+	}
+
+	group_wait = pv_group_wait(state, now, pending);
+	if (group_wait > wait * 1000000000.0)
+		return group_wait;
+
+	return (long long) (wait * 1000000000.0) + (wait > 0 ? 1 : 0);
+}
+
+
+/*
+ * Prepare the given transfer state to pipe data from its list of files to
+ * the output: work out the total size, initialise the cursor positioning,
+ * open the output (if it is not standard output) and the first input
+ * file, size the buffer, and start the clocks.
  *
  * Returns nonzero on error.
  */
-int pv_main_loop(opts_t opts)
+int pv_loop_init(pv_state_t state)
 {
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
+	struct stat64 sb;
+
+	l->fd = -1;
+
+	/*
+	 * Unless the size was given with -s, work out what it is, and don't
+	 * show an ETA if there is no way to know it.
+	 */
+	l->size = opts->size;
+	state->size = opts->size;
+	if (state->size == 0)
+		pv_calc_total_size(state);
+	if ((state->size < 1) && (!state->count_later))
+		opts->eta = 0;
+
+	pv_crs_init(state);
+
+	l->eof_in = 0;
+	l->eof_out = 0;
+	l->total_written = 0;
+	l->since_last = 0;
+	l->bytes_total = 0;
+	l->file_bytes = 0;
+	l->file_lines = 0;
+
+	l->start_time = pv_now_nsec();
+	l->toffset_start = pv_sig_toffset;
+
+	l->next_update =
+	    l->start_time + (long long) (1000000000.0 * opts->interval);
+
+	/*
+	 * The rate limit buckets start off full, so the first burst can be
+	 * written straight away.
+	 */
+	l->bucket_time = l->start_time;
+	l->rate_start = l->bucket_time;
+	l->schedule_next = 0;
+	l->paced = 0;
+	pv__deadline_init(state, l->bucket_time);
+	pv__rate_update(state, l->bucket_time);
+	l->tokens = 0;
+	l->line_tokens = 0;
+	if (l->rate > 0)
+		l->tokens = pv__bucket_size(opts, l->rate, l->paced);
+	if (opts->line_rate_limit > 0)
+		l->line_tokens =
+		    pv__bucket_size(opts, opts->line_rate_limit, 0);
+	l->final_update = 0;
+	l->filenum = 0;
+
+	if (opts->output != NULL) {
+		state->output_fd =
+		    open64(opts->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (state->output_fd < 0) {
+			fprintf(stderr, "%s: %s: %s: %s\n",
+				opts->program_name,
+				_("failed to open output file"),
+				opts->output, strerror(errno));
+			state->exit_status |= 2;
+			return -1;
+		}
+	}
+
+	l->fd = pv_next_file(state, l->filenum, -1, state->output_fd);
+	if (l->fd < 0)
+		return -1;
+
+	if (fstat64(l->fd, &sb) == 0) {
+		pv_set_buffer_size(state, sb.st_blksize * 32, 0);
+	}
+
+	l->buffer_size = opts->buffer_size;
+	if (opts->buffer_size > 0) {
+		pv_set_buffer_size(state, opts->buffer_size, 1);
+	}
+
+	l->limited = pv__limited(state);
+	l->transfer = pv_transfer_select(state);
+
+	if (pv_group_init(state) != 0)
+		return -1;
+
+	pv_adaptive_init(state, pv_now_nsec());
+
+	pv__pacing_init(state);
+	pv__pacing_set(state, l->rate);
+
+	pv_count_start(state);
+
+	return 0;
+}
+
+
+/*
+ * Perform a single iteration of the main loop for the given transfer state:
+ * transfer some data, moving on to the next file if necessary, and update
+ * the display if it is time to do so.
+ *
+ * Returns 0 if the transfer should continue, 1 if it has finished or has
+ * been aborted by a signal, or -1 on error.
+ */
+int pv_loop_step(pv_state_t state)
+{
+	struct pv_loop_state *l = &(state->loop);
+	opts_t opts = state->opts;
 	long written, lineswritten;
-	long long total_written, since_last, cansend, donealready, target;
-	int eof_in, eof_out, final_update;
-	struct timeval start_time, next_update, next_reset, cur_time;
-	struct timeval init_time;
+	unsigned long long cansend, records;
+	long long now, wait, interval;
 	long double elapsed;
-	struct stat64 sb;
-	int fd, n;
 
 	/*
 	 * "written" is ALWAYS bytes written by the last transfer.
@@ -128,208 +632,359 @@ int pv_main_loop(opts_t opts)
 	 * The remaining variables are all unchanged by linemode.
 	 */
 
-	fd = -1;
-
-	pv_crs_init(opts);
-
-	eof_in = 0;
-	eof_out = 0;
-	total_written = 0;
-	since_last = 0;
+	if ((l->eof_in && l->eof_out) && l->final_update)
+		return 1;
 
-	gettimeofday(&start_time, NULL);
-	gettimeofday(&cur_time, NULL);
-
-	next_update.tv_sec = start_time.tv_sec;
-	next_update.tv_usec = start_time.tv_usec;
-	pv_timeval_add_usec(&next_update,
-			    (long) (1000000.0 * opts->interval));
+	if (pv_sig_abort)
+		return 1;
 
-	next_reset.tv_sec = start_time.tv_sec;
-	next_reset.tv_usec = start_time.tv_usec;
-	pv_timeval_add_usec(&next_reset, RATE_GRANULARITY);
+	/*
+	 * Apply any change of size, buffer size or rate limiting made
+	 * remotely (see remote.c) or by the rate limit schedule, switching
+	 * transfer functions if rate limiting has been turned on or off.
+	 * The time is only needed if the rate limit depends on it, or there
+	 * is one.
+	 */
+	now = 0;
+	if ((l->limited) || (opts->rate_schedule != NULL) || (opts->ramp > 0)
+	    || (l->deadline > 0) || (opts->adaptive_limit > 0))
+		now = pv_now_nsec();
+	pv__rate_update(state, now);
+
+	if (opts->size != l->size) {
+		l->size = opts->size;
+		if (opts->size > 0)
+			state->size = opts->size;
+	}
+	if (opts->buffer_size != l->buffer_size) {
+		l->buffer_size = opts->buffer_size;
+		if (opts->buffer_size > 0)
+			pv_set_buffer_size(state, opts->buffer_size, 1);
+	}
+	if (pv__limited(state) != l->limited) {
+		l->limited = pv__limited(state);
+		l->transfer = pv_transfer_select(state);
+	}
 
+	/*
+	 * When rate limited, top up the token buckets, and if they don't
+	 * yet hold enough to write what is waiting, sleep until they will
+	 * (but not for so long that the display stops being updated). Then
+	 * we may send as many bytes as there are tokens, and with a line
+	 * rate limit, only as many as make up the complete lines we have
+	 * tokens for. In a rate group, we can only send what the group
+	 * has reserved for us.
+	 */
 	cansend = 0;
-	donealready = 0;
-	final_update = 0;
-	n = 0;
-
-	fd = pv_next_file(opts, n, -1);
-	if (fd < 0) {
-		return opts->exit_status;
+	if (l->limited) {
+		if (now == 0)
+			now = pv_now_nsec();
+		pv__bucket_refill(state, now);
+		wait =
+		    state->transfer.nowait ? 0 : pv__bucket_wait(state, now);
+		if (wait > RATE_MAX_WAIT)
+			wait = RATE_MAX_WAIT;
+		if (wait > 0) {
+			pv_sleep_until(now, wait);
+			now = pv_now_nsec();
+			pv__bucket_refill(state, now);
+		}
+		cansend = state->transfer.in_buffer
+		    - state->transfer.bytes_written;
+		if (cansend == 0)
+			cansend = state->transfer.bufsize;
+		if (l->rate > 0)
+			cansend = (unsigned long long) (l->tokens);
+		if (opts->line_rate_limit > 0) {
+			records =
+			    pv_transfer_records(state,
+						(unsigned long long)
+						(l->line_tokens), l->eof_in);
+			if ((l->rate == 0) || (records < cansend))
+				cansend = records;
+		}
+		cansend =
+		    pv_group_allow(state, now, cansend,
+				   state->transfer.in_buffer -
+				   state->transfer.bytes_written);
 	}
 
-	if (fstat64(fd, &sb) == 0) {
-		pv_set_buffer_size(sb.st_blksize * 32, 0);
+	written =
+	    l->transfer(state, l->fd, &(l->eof_in), &(l->eof_out),
+			cansend, &lineswritten);
+	if (written < 0)
+		return -1;
+	pv_group_used(state, written);
+
+	if (opts->linemode) {
+		l->since_last += lineswritten;
+		l->total_written += lineswritten;
+		l->bytes_total += written;
+	} else {
+		l->since_last += written;
+		l->total_written += written;
 	}
-
-	if (opts->buffer_size > 0) {
-		pv_set_buffer_size(opts->buffer_size, 1);
+	if (l->rate > 0)
+		l->tokens -= written;
+	if (opts->line_rate_limit > 0)
+		l->line_tokens -= lineswritten;
+
+	if (l->eof_in && l->eof_out && l->filenum < (opts->argc - 1)) {
+		pv__cache_lines(state);
+		l->filenum++;
+		l->fd =
+		    pv_next_file(state, l->filenum, l->fd, state->output_fd);
+		if (l->fd < 0)
+			return -1;
+		l->eof_in = 0;
+		l->eof_out = 0;
 	}
 
-	while ((!(eof_in && eof_out)) || (!final_update)) {
-
-		if (pv_sig_abort)
-			break;
+	if (l->eof_in && l->eof_out) {
+		if (!l->final_update)
+			pv__cache_lines(state);
 
-		if (opts->rate_limit > 0) {
-			target =
-			    ((long double) (opts->rate_limit)) /
-			    (long double) (1000000 / RATE_GRANULARITY);
-			cansend = target - donealready;
-			if (target < donealready)
-				cansend = 0;
+		/*
+		 * Flush the output to disk before the final update if asked
+		 * to, so the final rate includes the time taken to make the
+		 * data durable.
+		 */
+		if ((!l->final_update) && (opts->sync_at_end)
+		    && (fdatasync(state->output_fd) != 0)
+		    && (errno != EINVAL) && (errno != EROFS)) {
+			fprintf(stderr, "%s: %s: %s\n",
+				opts->program_name,
+				_("failed to sync output"), strerror(errno));
+			state->exit_status |= 16;
 		}
+		l->final_update = 1;
+		l->next_update = 0;
+	}
 
-		written =
-		    pv_transfer(opts, fd, &eof_in, &eof_out, cansend,
-				&lineswritten);
-		if (written < 0)
-			return opts->exit_status;
+	if (opts->no_op)
+		return 0;
 
+	/*
+	 * If -W was given, we don't output anything until we have written
+	 * a byte (or line, in line mode), at which point we then count time
+	 * as if we started when the first byte was received.
+	 */
+	if (opts->wait) {
 		if (opts->linemode) {
-			since_last += lineswritten;
-			total_written += lineswritten;
+			if (lineswritten < 1)
+				return 0;
 		} else {
-			since_last += written;
-			total_written += written;
-		}
-		if (opts->rate_limit > 0)
-			donealready += written;
-
-		if (eof_in && eof_out && n < (opts->argc - 1)) {
-			n++;
-			fd = pv_next_file(opts, n, fd);
-			if (fd < 0)
-				return opts->exit_status;
-			eof_in = 0;
-			eof_out = 0;
+			if (written < 1)
+				return 0;
 		}
 
-		gettimeofday(&cur_time, NULL);
+		opts->wait = 0;
 
-		if (eof_in && eof_out) {
-			final_update = 1;
-			next_update.tv_sec = cur_time.tv_sec - 1;
-		}
+		/*
+		 * Take a new note of the timer offset counter now that data
+		 * transfer has begun, otherwise if we had been stopped and
+		 * started (with ^Z / SIGTSTOP) previously (while waiting for
+		 * data), the timers will be wrongly offset.
+		 *
+		 * While we read the offset counter we must disable SIGTSTOP
+		 * so things don't mess up.
+		 */
+		pv_sig_nopause();
+		l->start_time = pv_now_nsec();
+		l->toffset_start = pv_sig_toffset;
+		pv_sig_allowpause();
 
-		if ((cur_time.tv_sec > next_reset.tv_sec)
-		    || (cur_time.tv_sec == next_reset.tv_sec
-			&& cur_time.tv_usec >= next_reset.tv_usec)) {
-			pv_timeval_add_usec(&next_reset, RATE_GRANULARITY);
-			if (next_reset.tv_sec < cur_time.tv_sec)
-				next_reset.tv_sec = cur_time.tv_sec;
-			donealready = 0;
-		}
+		l->next_update = l->start_time
+		    + (long long) (1000000000.0 * opts->interval);
+	}
 
-		if (opts->no_op)
-			continue;
+	/*
+	 * The cheaper, coarse clock is good enough to tell whether an update
+	 * is due; only if it is do we need the exact time.
+	 */
+	if (pv_now_coarse_nsec() < l->next_update)
+		return 0;
 
-		/*
-		 * If -W was given, we don't output anything until we have
-		 * written a byte (or line, in line mode), at which point
-		 * we then count time as if we started when the first byte
-		 * was received.
-		 */
-		if (opts->wait) {
-			if (opts->linemode) {
-				if (lineswritten < 1)
-					continue;
-			} else {
-				if (written < 1)
-					continue;
-			}
-
-			opts->wait = 0;
-
-			/*
-			 * Reset the timer offset counter now that data
-			 * transfer has begun, otherwise if we had been
-			 * stopped and started (with ^Z / SIGTSTOP)
-			 * previously (while waiting for data), the timers
-			 * will be wrongly offset.
-			 *
-			 * While we reset the offset counter we must disable
-			 * SIGTSTOP so things don't mess up.
-			 */
-			pv_sig_nopause();
-			gettimeofday(&start_time, NULL);
-			pv_sig_toffset.tv_sec = 0;
-			pv_sig_toffset.tv_usec = 0;
-			pv_sig_allowpause();
-
-			next_update.tv_sec = start_time.tv_sec;
-			next_update.tv_usec = start_time.tv_usec;
-			pv_timeval_add_usec(&next_update,
-					    (long) (1000000.0 *
-						    opts->interval));
-		}
+	now = pv_now_nsec();
+	interval = (long long) (1000000000.0 * opts->interval);
 
-		if ((cur_time.tv_sec < next_update.tv_sec)
-		    || (cur_time.tv_sec == next_update.tv_sec
-			&& cur_time.tv_usec < next_update.tv_usec)) {
-			continue;
-		}
+	l->next_update += interval;
+	if (l->next_update < now)
+		l->next_update = now;
+
+	/*
+	 * The transfer started at "start_time", plus however long we have
+	 * spent stopped since then.
+	 */
+	elapsed = ((long double) (now - l->start_time
+				  - (pv_sig_toffset - l->toffset_start)))
+	    / 1000000000.0;
 
-		pv_timeval_add_usec(&next_update,
-				    (long) (1000000.0 * opts->interval));
+	if (l->final_update)
+		l->since_last = -1;
 
-		if (next_update.tv_sec < cur_time.tv_sec) {
-			next_update.tv_sec = cur_time.tv_sec;
-			next_update.tv_usec = cur_time.tv_usec;
-		} else if (next_update.tv_sec == cur_time.tv_sec
-			   && next_update.tv_usec < cur_time.tv_usec) {
-			next_update.tv_usec = cur_time.tv_usec;
-		}
+	if (pv_sig_newsize) {
+		pv_sig_newsize = 0;
+		pv_screensize(opts);
+	}
 
-		init_time.tv_sec =
-		    start_time.tv_sec + pv_sig_toffset.tv_sec;
-		init_time.tv_usec =
-		    start_time.tv_usec + pv_sig_toffset.tv_usec;
-		if (init_time.tv_usec >= 1000000) {
-			init_time.tv_sec++;
-			init_time.tv_usec -= 1000000;
-		}
-		if (init_time.tv_usec < 0) {
-			init_time.tv_sec--;
-			init_time.tv_usec += 1000000;
-		}
+	pv__refine_estimate(state);
+	pv_count_poll(state, l->final_update);
+
+	pv_display(state, elapsed, l->since_last, l->total_written);
 
-		elapsed = cur_time.tv_sec - init_time.tv_sec;
-		elapsed +=
-		    (cur_time.tv_usec - init_time.tv_usec) / 1000000.0;
+	l->since_last = 0;
+
+	return 0;
+}
 
-		if (final_update)
-			since_last = -1;
 
-		if (pv_sig_newsize) {
-			pv_sig_newsize = 0;
-			pv_screensize(opts);
+/*
+ * Add the file descriptors that the given transfer state is waiting on to
+ * the given sets, for callers running several transfers in one select()
+ * loop, and return the highest descriptor added, or -1 if none were.
+ *
+ * The output is only waited on if there is data ready to be written to it
+ * that the watermarks and rate limit would allow pv_loop_step() to write;
+ * if it is the rate limit holding it back, *tv is lowered to the time
+ * until it won't be.
+ */
+int pv_loop_fds(pv_state_t state, fd_set *readfds, fd_set *writefds,
+		struct timeval *tv)
+{
+	struct pv_loop_state *l = &(state->loop);
+	struct pv_transfer_state *t = &(state->transfer);
+	opts_t opts = state->opts;
+	unsigned long pending;
+	long long now, wait;
+	int max_fd = -1;
+
+	if ((!l->eof_in) && (l->fd >= 0)
+	    && ((t->buf == NULL) || (t->in_buffer < t->bufsize))) {
+		FD_SET(l->fd, readfds);
+		max_fd = l->fd;
+	}
+
+	pending = t->in_buffer - t->bytes_written;
+	if ((l->eof_out) || (pending == 0))
+		return max_fd;
+
+	if ((opts->high_water > 0) && (t->prebuffering) && (!l->eof_in)
+	    && (pending < (t->bufsize * opts->high_water) / 100))
+		return max_fd;
+
+	if (l->limited) {
+		now = pv_now_nsec();
+		pv__bucket_refill(state, now);
+		wait = pv__bucket_wait(state, now);
+		if (wait > 0) {
+			wait /= 1000;
+			if ((tv->tv_sec == 0) && (wait < tv->tv_usec))
+				tv->tv_usec = wait;
+			return max_fd;
 		}
+		if ((opts->line_rate_limit > 0)
+		    && (pv_transfer_records(state,
+					    (unsigned long long)
+					    (l->line_tokens), l->eof_in) < 1))
+			return max_fd;
+	}
+
+	FD_SET(state->output_fd, writefds);
+	if (state->output_fd > max_fd)
+		max_fd = state->output_fd;
+
+	return max_fd;
+}
+
+
+/*
+ * Finish off the display for the given transfer state, once the main loop
+ * has completed, and return the exit status.
+ */
+int pv_loop_fini(pv_state_t state)
+{
+	opts_t opts = state->opts;
+	int fd;
 
-		pv_display(opts, elapsed, since_last, total_written);
+	pv_count_poll(state, 1);
 
-		since_last = 0;
+	/*
+	 * Don't leave the kernel pacing a socket we were given to someone
+	 * else who might carry on using it.
+	 */
+	pv__pacing_set(state, 0);
+
+	/*
+	 * Close the output before waiting for the display to finish, so that
+	 * whatever is reading it sees the end of the data even if standard
+	 * error is stuck. Standard output belongs to whoever called us, so
+	 * it is only let go of if opts->release_stdout says we may, and then
+	 * it is replaced with /dev/null rather than closed, so that the
+	 * descriptor can't be reused by mistake.
+	 */
+	if ((opts->output != NULL) && (state->output_fd >= 0)) {
+		if (close(state->output_fd)) {
+			fprintf(stderr, "%s: %s: %s: %s\n",
+				opts->program_name,
+				_("failed to close output file"),
+				opts->output, strerror(errno));
+			state->exit_status |= 16;
+		}
+		state->output_fd = -1;
+	} else if ((state->output_fd == STDOUT_FILENO)
+		   && (opts->release_stdout)) {
+		fd = open("/dev/null", O_WRONLY);   /* RATS: ignore (no race) */
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
 	}
 
+	pv_display_stop(state);
+
 	if (opts->cursor) {
-		pv_crs_fini(opts);
-	} else {
+		pv_crs_fini(state);
+	} else if (!state->display.buffered) {
 		if ((!opts->numeric) && (!opts->no_op))
 			write(STDERR_FILENO, "\n", 1);
 	}
 
-	/*
-	 * Free up the buffers used by the display and data transfer
-	 * routines.
-	 */
-	pv_display(0, 0, 0, 0);
-	pv_transfer(0, -1, 0, 0, 0, NULL);
-
 	if (pv_sig_abort)
-		opts->exit_status |= 32;
+		state->exit_status |= 32;
+
+	return state->exit_status;
+}
+
+
+/*
+ * Pipe data from a list of files to standard output, giving information
+ * about the transfer on standard error according to the given options.
+ *
+ * Returns nonzero on error.
+ */
+int pv_main_loop(opts_t opts)
+{
+	pv_state_t state;
+	int rc;
+
+	state = pv_state_alloc(opts);
+	if (state == NULL)
+		return 64;
+
+	if (pv_loop_init(state) == 0) {
+		while ((rc = pv_loop_step(state)) == 0) {
+			/* keep going */ ;
+		}
+		if (rc > 0)
+			pv_loop_fini(state);
+	}
+
+	rc = state->exit_status;
+
+	pv_state_free(state);
 
-	return opts->exit_status;
+	return rc;
 }
 
 /* EOF */
@@ -0,0 +1,351 @@
+/*
+ * Multi-stream main loop - run several transfers, each with its own input,
+ * output, buffer and display line, from a single select() loop.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#define _GNU_SOURCE 1
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+extern sig_atomic_t pv_sig_newsize;
+extern sig_atomic_t pv_sig_abort;
+
+
+/*
+ * Fill in "sopts" as a copy of "opts" for a single stream, described by
+ * "spec" in the form INPUT:OUTPUT[:NAME], which is modified in place.
+ *
+ * Returns nonzero on error, which calls for an exit status of 2.
+ */
+static int pv__multi_parse(opts_t opts, char *spec, opts_t sopts,
+			   char **input)
+{
+	char *output;
+	char *name;
+
+	*sopts = *opts;
+
+	output = strchr(spec, ':');
+	if ((output == NULL) || (output == spec) || (output[1] == 0)) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("stream must be INPUT:OUTPUT[:NAME]"), spec);
+		return 1;
+	}
+	*(output++) = 0;
+
+	name = strchr(output, ':');
+	if (name != NULL) {
+		*(name++) = 0;
+		if (name[0] == 0)
+			name = NULL;
+	}
+
+	*input = spec;
+	sopts->argc = 1;
+	sopts->argv = input;
+	sopts->output = (strcmp(output, "-") == 0) ? NULL : output;
+	sopts->name = (name != NULL) ? name : spec;
+	sopts->cursor = 0;
+
+	return 0;
+}
+
+
+/*
+ * Put "fd" into non-blocking mode unless it is a regular file, so that one
+ * slow reader can't hold up all the other streams. Returns its previous
+ * file status flags, or -1 if they weren't changed.
+ */
+static long pv__multi_nonblock(int fd)
+{
+	struct stat64 sb;
+	long flags;
+
+	if ((fstat64(fd, &sb) != 0) || (S_ISREG(sb.st_mode)))
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if ((flags < 0) || (flags & O_NONBLOCK))
+		return -1;
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		return -1;
+
+	return flags;
+}
+
+
+/*
+ * Pass on to each of the "count" streams' options in "sopts" any settings
+ * changed remotely (see remote.c) in "opts" since "last", which is then
+ * brought up to date. The name is not passed on, since it is what tells
+ * the streams apart.
+ */
+static void pv__multi_remote(opts_t opts, opts_t last, struct opts_s *sopts,
+			     int count)
+{
+	int i;
+
+#define PV_MULTI_PASS_ON(field) \
+	if (opts->field != last->field) { \
+		for (i = 0; i < count; i++) \
+			sopts[i].field = opts->field; \
+		last->field = opts->field; \
+	}
+
+	PV_MULTI_PASS_ON(progress);
+	PV_MULTI_PASS_ON(timer);
+	PV_MULTI_PASS_ON(eta);
+	PV_MULTI_PASS_ON(rate);
+	PV_MULTI_PASS_ON(average_rate);
+	PV_MULTI_PASS_ON(rate_schedule);
+	PV_MULTI_PASS_ON(rate_limit);
+	PV_MULTI_PASS_ON(buffer_size);
+	PV_MULTI_PASS_ON(size);
+	PV_MULTI_PASS_ON(interval);
+	PV_MULTI_PASS_ON(width);
+	PV_MULTI_PASS_ON(height);
+
+#undef PV_MULTI_PASS_ON
+}
+
+
+/*
+ * Draw the current line of every stream as a single block, moving the
+ * cursor back up over the previous block first if there was one. The
+ * block is assembled in *frame, which is grown as necessary.
+ */
+static void pv__multi_draw(pv_state_t *states, int count, int *drawn,
+			   char **frame, long *framesize)
+{
+	long need, len;
+	char *line;
+	char *buf;
+	int i;
+
+	need = 32;
+	for (i = 0; i < count; i++) {
+		line = states[i]->display.line;
+		need += 8 + (line ? strlen(line) : 0);	/* RATS: ignore */
+	}
+
+	if (need > *framesize) {
+		buf = realloc(*frame, need);
+		if (buf == NULL)
+			return;
+		*frame = buf;
+		*framesize = need;
+	}
+	buf = *frame;
+
+	len = 0;
+	if (*drawn)
+		len += sprintf(buf, "\033[%dA", count);
+
+	for (i = 0; i < count; i++) {
+		line = states[i]->display.line;
+		memcpy(buf + len, "\r\033[K", 4);
+		len += 4;
+		if (line != NULL) {
+			strcpy(buf + len, line);    /* RATS: ignore */
+			len += strlen(line);	/* RATS: ignore */
+		}
+		buf[len++] = '\n';
+		states[i]->display.changed = 0;
+	}
+
+	write(STDERR_FILENO, buf, len);
+	*drawn = 1;
+}
+
+
+/*
+ * Run each of the non-option arguments in "opts", which are in the form
+ * INPUT:OUTPUT[:NAME], as a separate transfer, all in the same select()
+ * loop, giving one line of information about each on standard error.
+ *
+ * Returns nonzero on error.
+ */
+int pv_multi_main_loop(opts_t opts)
+{
+	struct opts_s *sopts;
+	struct opts_s last;
+	pv_state_t *states;
+	char **inputs;
+	char *running;
+	char *frame;
+	long framesize, flags, stdout_flags;
+	int count, active, changed, drawn, rc, max_fd, fd, i;
+	unsigned char exit_status;
+	struct timeval tv;
+	fd_set readfds;
+	fd_set writefds;
+
+	count = opts->argc;
+	last = *opts;
+	stdout_flags = -1;
+	exit_status = 0;
+
+	sopts = calloc(count, sizeof(*sopts));
+	states = calloc(count, sizeof(*states));
+	inputs = calloc(count, sizeof(*inputs));
+	running = calloc(count, sizeof(*running));
+	if ((sopts == NULL) || (states == NULL) || (inputs == NULL)
+	    || (running == NULL)) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("stream allocation failed"), strerror(errno));
+		exit_status |= 64;
+		count = 0;
+	}
+
+	/*
+	 * Parse every stream before starting any, so that a typing mistake
+	 * doesn't leave some outputs truncated and others untouched.
+	 */
+	for (i = 0; i < count; i++) {
+		if (pv__multi_parse(opts, opts->argv[i], &(sopts[i]),
+				    &(inputs[i]))) {
+			exit_status |= 2;
+			count = 0;
+		}
+	}
+
+	active = 0;
+	for (i = 0; i < count; i++) {
+		states[i] = pv_state_alloc(&(sopts[i]));
+		if (states[i] == NULL) {
+			exit_status |= 64;
+			continue;
+		}
+		states[i]->transfer.nowait = 1;
+		states[i]->display.buffered = 1;
+		if (pv_loop_init(states[i]) != 0)
+			continue;
+		/*
+		 * Make every output non-blocking, so that one slow reader
+		 * can't hold up all the other streams. Standard output's
+		 * flags are shared with whoever else has it open, so they
+		 * are put back afterwards.
+		 */
+		fd = states[i]->output_fd;
+		flags = pv__multi_nonblock(fd);
+		if ((fd == STDOUT_FILENO) && (flags >= 0))
+			stdout_flags = flags;
+		running[i] = 1;
+		active++;
+	}
+
+	drawn = 0;
+	frame = NULL;
+	framesize = 0;
+
+	while (active > 0) {
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		max_fd = -1;
+		tv.tv_sec = 0;
+		tv.tv_usec = 90000;
+
+		for (i = 0; i < count; i++) {
+			if (!running[i])
+				continue;
+			fd = pv_loop_fds(states[i], &readfds, &writefds,
+					 &tv);
+			if (fd > max_fd)
+				max_fd = fd;
+			/*
+			 * A stream which has finished only needs its final
+			 * update, so don't wait around for it.
+			 */
+			if (states[i]->loop.eof_in
+			    && states[i]->loop.eof_out)
+				tv.tv_usec = 0;
+		}
+
+		if ((select(max_fd + 1, &readfds, &writefds, NULL, &tv) < 0)
+		    && (errno != EINTR)) {
+			fprintf(stderr, "%s: %s: %s\n",
+				opts->program_name,
+				_("select call failed"), strerror(errno));
+			exit_status |= 16;
+			break;
+		}
+
+		if (pv_sig_newsize) {
+			pv_sig_newsize = 0;
+			for (i = 0; i < count; i++)
+				pv_screensize(&(sopts[i]));
+		}
+
+		pv__multi_remote(opts, &last, sopts, count);
+
+		changed = 0;
+
+		for (i = 0; i < count; i++) {
+			if (!running[i])
+				continue;
+			rc = pv_loop_step(states[i]);
+			if (states[i]->display.changed)
+				changed = 1;
+			if (rc == 0)
+				continue;
+			if (rc > 0)
+				pv_loop_fini(states[i]);
+			running[i] = 0;
+			active--;
+		}
+
+		if (changed)
+			pv__multi_draw(states, count, &drawn, &frame,
+				       &framesize);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (states[i] == NULL)
+			continue;
+		if (running[i])
+			pv_loop_fini(states[i]);
+		exit_status |= states[i]->exit_status;
+		pv_state_free(states[i]);
+	}
+
+	if (stdout_flags >= 0)
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+
+	if (pv_sig_abort)
+		exit_status |= 32;
+
+	if (frame)
+		free(frame);
+	if (sopts)
+		free(sopts);
+	if (states)
+		free(states);
+	if (inputs)
+		free(inputs);
+	if (running)
+		free(running);
+
+	return exit_status;
+}
+
+/* EOF */
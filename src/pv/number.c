@@ -147,6 +147,73 @@ int pv_getnum_i(char *str)
 }
 
 
+/*
+ * Return the byte described by "str", or -1 if it does not describe one.
+ *
+ * A single character stands for itself; otherwise "str" may be one of the
+ * escapes \0, \n, \r, \t or \\, or a number from 0 to 255 in decimal, in
+ * octal with a leading 0, or in hexadecimal with a leading 0x.
+ */
+int pv_getbyte(char *str)
+{
+	int base, digit, n;
+
+	if ((str == 0) || (str[0] == 0))
+		return -1;
+
+	if (str[1] == 0)
+		return (unsigned char) (str[0]);
+
+	if ((str[0] == '\\') && (str[2] == 0)) {
+		switch (str[1]) {
+		case '0':
+			return 0;
+		case 'n':
+			return '\n';
+		case 'r':
+			return '\r';
+		case 't':
+			return '\t';
+		case '\\':
+			return '\\';
+		default:
+			return -1;
+		}
+	}
+
+	base = 10;
+	if ((str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X'))) {
+		base = 16;
+		str += 2;
+	} else if (str[0] == '0') {
+		base = 8;
+		str++;
+	}
+
+	if (str[0] == 0)
+		return -1;
+
+	for (n = 0; str[0] != 0; str++) {
+		if (pv__isdigit(str[0])) {
+			digit = str[0] - '0';
+		} else if ((str[0] >= 'a') && (str[0] <= 'f')) {
+			digit = 10 + str[0] - 'a';
+		} else if ((str[0] >= 'A') && (str[0] <= 'F')) {
+			digit = 10 + str[0] - 'A';
+		} else {
+			return -1;
+		}
+		if (digit >= base)
+			return -1;
+		n = (n * base) + digit;
+		if (n > 255)
+			return -1;
+	}
+
+	return n;
+}
+
+
 /*
  * Return nonzero if the given string is not a valid integer (type=0) or
  * double (type=1).
@@ -0,0 +1,260 @@
+/*
+ * Functions for rate limit schedules, such as
+ * "09:00-18:00=20M,18:00-09:00=unlimited", which give a different -L rate
+ * limit for different times of day.
+ *
+ * Each entry is a local time range and the rate to use within it; a range
+ * whose end is not after its start runs on past midnight. The first entry
+ * covering the current time applies, and if none do, there is no limit.
+ *
+ * Also here is the parsing of --finish-by deadlines.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#include "pv.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+/*
+ * Parse a time of day in the form HH:MM at *str into minutes since
+ * midnight, moving *str past it.
+ *
+ * Returns -1 if there is no valid time there.
+ */
+static int pv__schedule_time(const char **str)
+{
+	const char *ptr = *str;
+	int hours, minutes;
+
+	if ((ptr[0] < '0') || (ptr[0] > '9'))
+		return -1;
+	hours = ptr[0] - '0';
+	ptr++;
+	if ((ptr[0] >= '0') && (ptr[0] <= '9')) {
+		hours = (hours * 10) + ptr[0] - '0';
+		ptr++;
+	}
+
+	if ((ptr[0] != ':') || (ptr[1] < '0') || (ptr[1] > '5')
+	    || (ptr[2] < '0') || (ptr[2] > '9'))
+		return -1;
+	minutes = ((ptr[1] - '0') * 10) + ptr[2] - '0';
+	ptr += 3;
+
+	if (hours > 24 || ((hours == 24) && (minutes > 0)))
+		return -1;
+
+	*str = ptr;
+
+	return (hours * 60) + minutes;
+}
+
+
+/*
+ * Parse the schedule entry "HH:MM-HH:MM=RATE" at *str into its start and
+ * end in minutes since midnight and its rate, which is 0 if RATE is
+ * "unlimited", moving *str past the entry and any comma after it.
+ *
+ * Returns nonzero if the entry is not valid.
+ */
+static int pv__schedule_entry(const char **str, int *start, int *end,
+			      unsigned long long *rate)
+{
+	char ratestr[32];		 /* RATS: ignore (checked) */
+	const char *ptr = *str;
+	size_t len;
+
+	*start = pv__schedule_time(&ptr);
+	if ((*start < 0) || (ptr[0] != '-'))
+		return 1;
+	ptr++;
+
+	*end = pv__schedule_time(&ptr);
+	if ((*end < 0) || (ptr[0] != '='))
+		return 1;
+	ptr++;
+
+	len = strcspn(ptr, ",");
+	if ((len < 1) || (len >= sizeof(ratestr)))
+		return 1;
+	memcpy(ratestr, ptr, len);
+	ratestr[len] = 0;
+	ptr += len;
+	if (ptr[0] == ',')
+		ptr++;
+
+	if (strcmp(ratestr, "unlimited") == 0) {
+		*rate = 0;
+	} else if (pv_getnum_check(ratestr, 0) == 0) {
+		*rate = pv_getnum_ll(ratestr);
+	} else {
+		return 1;
+	}
+
+	*str = ptr;
+
+	return 0;
+}
+
+
+/*
+ * Return nonzero if "str" is not a valid rate limit schedule.
+ */
+int pv_schedule_check(const char *str)
+{
+	unsigned long long rate;
+	int start, end;
+
+	if ((str == NULL) || (str[0] == 0))
+		return 1;
+
+	while (str[0] != 0) {
+		if (pv__schedule_entry(&str, &start, &end, &rate))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Return the rate limit that the schedule "str" gives for the time "now",
+ * or 0 for no limit, and put into *until the time at which the rate might
+ * next change (the start of the next minute).
+ */
+unsigned long long pv_schedule_rate(const char *str, time_t now,
+				    time_t *until)
+{
+	unsigned long long rate;
+	struct tm *tm;
+	int start, end, minute;
+
+	tm = localtime(&now);
+	if (tm == NULL) {
+		*until = now + 60;
+		return 0;
+	}
+
+	minute = (tm->tm_hour * 60) + tm->tm_min;
+	*until = now + 60 - tm->tm_sec;
+
+	while ((str != NULL) && (str[0] != 0)) {
+		if (pv__schedule_entry(&str, &start, &end, &rate))
+			break;
+		if ((end > start) && (minute >= start) && (minute < end))
+			return rate;
+		if ((end <= start) && ((minute >= start) || (minute < end)))
+			return rate;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Parse the --finish-by time "str" relative to the time "now", putting the
+ * result in *deadline. This is either a local time of day HH:MM[:SS],
+ * meaning the next time that comes round, or "+" followed by a number of
+ * seconds, with an optional suffix of "m", "h" or "d" for minutes, hours
+ * or days.
+ *
+ * Returns nonzero if "str" is not a valid time.
+ */
+int pv_deadline_parse(const char *str, time_t now, time_t *deadline)
+{
+	struct tm *tm;
+	struct tm today, when;
+	long long n;
+	int minutes, seconds;
+
+	if (str == NULL)
+		return 1;
+
+	if (str[0] == '+') {
+		str++;
+		if ((str[0] < '0') || (str[0] > '9'))
+			return 1;
+		for (n = 0; (str[0] >= '0') && (str[0] <= '9'); str++)
+			n = (n * 10) + str[0] - '0';
+		switch (str[0]) {
+		case 'd':
+			n *= 24;
+			/* fall through */
+		case 'h':
+			n *= 60;
+			/* fall through */
+		case 'm':
+			n *= 60;
+			/* fall through */
+		case 's':
+			str++;
+			break;
+		default:
+			break;
+		}
+		if (str[0] != 0)
+			return 1;
+		*deadline = now + (time_t) n;
+		return 0;
+	}
+
+	minutes = pv__schedule_time(&str);
+	if (minutes < 0)
+		return 1;
+	seconds = 0;
+	if (str[0] == ':') {
+		if ((str[1] < '0') || (str[1] > '5') || (str[2] < '0')
+		    || (str[2] > '9'))
+			return 1;
+		seconds = ((str[1] - '0') * 10) + str[2] - '0';
+		str += 3;
+	}
+	if (str[0] != 0)
+		return 1;
+
+	tm = localtime(&now);
+	if (tm == NULL)
+		return 1;
+	today = *tm;
+	when = today;
+	when.tm_hour = minutes / 60;
+	when.tm_min = minutes % 60;
+	when.tm_sec = seconds;
+	when.tm_isdst = -1;
+	*deadline = mktime(&when);
+
+	/*
+	 * If that time has already gone today, it means tomorrow.
+	 */
+	if (*deadline <= now) {
+		when = today;
+		when.tm_mday++;
+		when.tm_hour = minutes / 60;
+		when.tm_min = minutes % 60;
+		when.tm_sec = seconds;
+		when.tm_isdst = -1;
+		*deadline = mktime(&when);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Return nonzero if "str" is not a valid --finish-by time.
+ */
+int pv_deadline_check(const char *str)
+{
+	time_t deadline;
+
+	return pv_deadline_parse(str, time(NULL), &deadline);
+}
+
+/* EOF */
@@ -4,7 +4,7 @@
  * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
  */
 
-#include "pv.h"
+#include "pv-internal.h"
 
 #include <signal.h>
 #include <termios.h>
@@ -20,16 +20,12 @@
 #endif
 
 static int pv__sig_old_stderr;		 /* see pv__sig_ttou() */
-static struct timeval pv__sig_tstp_time; /* see pv__sig_tstp() / __cont() */
+static long long pv__sig_tstp_time;	 /* see pv__sig_tstp() / __cont() */
 
-struct timeval pv_sig_toffset;		 /* total time spent stopped */
+long long pv_sig_toffset;		 /* total nsec spent stopped */
 sig_atomic_t pv_sig_newsize = 0;	 /* whether we need to get term size again */
 sig_atomic_t pv_sig_abort = 0;		 /* whether we need to abort right now */
 
-#ifdef HAVE_IPC
-void pv_crs_needreinit(void);
-#endif
-
 
 /*
  * Handle SIGTTOU (tty output for background process) by redirecting stderr
@@ -60,7 +56,7 @@ static void pv__sig_ttou(int s)
  */
 static void pv__sig_tstp(int s)
 {
-	gettimeofday(&pv__sig_tstp_time, NULL);
+	pv__sig_tstp_time = pv_now_nsec();
 	raise(SIGSTOP);
 }
 
@@ -72,12 +68,11 @@ static void pv__sig_tstp(int s)
  */
 static void pv__sig_cont(int s)
 {
-	struct timeval tv;
 	struct termios t;
 
 	pv_sig_newsize = 1;
 
-	if (pv__sig_tstp_time.tv_sec == 0) {
+	if (pv__sig_tstp_time == 0) {
 		tcgetattr(STDERR_FILENO, &t);
 		t.c_lflag |= TOSTOP;
 		tcsetattr(STDERR_FILENO, TCSANOW, &t);
@@ -87,21 +82,8 @@ static void pv__sig_cont(int s)
 		return;
 	}
 
-	gettimeofday(&tv, NULL);
-
-	pv_sig_toffset.tv_sec += (tv.tv_sec - pv__sig_tstp_time.tv_sec);
-	pv_sig_toffset.tv_usec += (tv.tv_usec - pv__sig_tstp_time.tv_usec);
-	if (pv_sig_toffset.tv_usec >= 1000000) {
-		pv_sig_toffset.tv_sec++;
-		pv_sig_toffset.tv_usec -= 1000000;
-	}
-	if (pv_sig_toffset.tv_usec < 0) {
-		pv_sig_toffset.tv_sec--;
-		pv_sig_toffset.tv_usec += 1000000;
-	}
-
-	pv__sig_tstp_time.tv_sec = 0;
-	pv__sig_tstp_time.tv_usec = 0;
+	pv_sig_toffset += pv_now_nsec() - pv__sig_tstp_time;
+	pv__sig_tstp_time = 0;
 
 	if (pv__sig_old_stderr != -1) {
 		dup2(pv__sig_old_stderr, STDERR_FILENO);
@@ -145,10 +127,8 @@ void pv_sig_init(void)
 	struct sigaction sa;
 
 	pv__sig_old_stderr = -1;
-	pv__sig_tstp_time.tv_sec = 0;
-	pv__sig_tstp_time.tv_usec = 0;
-	pv_sig_toffset.tv_sec = 0;
-	pv_sig_toffset.tv_usec = 0;
+	pv__sig_tstp_time = 0;
+	pv_sig_toffset = 0;
 
 	/*
 	 * Ignore SIGPIPE, so we don't die if stdout is a pipe and the other
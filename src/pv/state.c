@@ -0,0 +1,83 @@
+/*
+ * Functions for allocating and freeing the state of a single transfer.
+ *
+ * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
+ */
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+/*
+ * Allocate and return a new transfer state using the given options, or
+ * NULL on error, which calls for an exit status of 64.
+ *
+ * The state keeps the "opts" pointer rather than a copy of the options,
+ * so "opts" must not be freed until the state has been freed with
+ * pv_state_free().
+ */
+pv_state_t pv_state_alloc(opts_t opts)
+{
+	pv_state_t state;
+
+	state = calloc(1, sizeof(*state));
+	if (state == NULL) {
+		fprintf(stderr, "%s: %s: %s\n",
+			opts->program_name,
+			_("state allocation failed"), strerror(errno));
+		return NULL;
+	}
+
+	state->opts = opts;
+	state->output_fd = STDOUT_FILENO;
+	state->current_file = "(stdin)";
+
+	state->transfer.splice_failed_fd = -1;
+	state->transfer.wb_active = -1;
+
+	state->cursor.shmid = -1;
+	state->cursor.pvcount = 1;
+	state->cursor.lock_fd = -1;
+
+	state->group.shmid = -1;
+	state->group.lock_fd = -1;
+
+	state->adaptive.psi_fd = -1;
+
+	state->loop.fd = -1;
+
+	return state;
+}
+
+
+/*
+ * Free the given transfer state, including the buffers used by the display
+ * and data transfer routines.
+ */
+void pv_state_free(pv_state_t state)
+{
+	if (state == NULL)
+		return;
+
+	pv_count_poll(state, 1);
+	pv_group_fini(state);
+	pv_adaptive_fini(state);
+	pv_transfer_free(state);
+	pv_display_free(state);
+
+	if ((state->opts->output != NULL) && (state->output_fd >= 0))
+		close(state->output_fd);
+
+	free(state);
+}
+
+/* EOF */
@@ -4,14 +4,16 @@
  * Copyright 2010 Andrew Wood, distributed under the Artistic License 2.0.
  */
 
-#include "options.h"
+#define _GNU_SOURCE 1			    /* for splice() */
+
+#include "pv-internal.h"
 
 #define BUFFER_SIZE	409600
 #define BUFFER_SIZE_MAX	524288
 
 #define MAXIMISE_BUFFER_FILL	1
 
-#define _GNU_SOURCE 1			    /* for splice() */
+#define SKIP_BLOCK_SIZE	512		    /* smallest unit skipped on error */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,117 +32,425 @@
 #include "config.h"
 #endif
 
-static unsigned long long pv__bufsize = BUFFER_SIZE;
+#ifdef HAVE_MLOCK
+#include <sys/mman.h>
+#endif
 
+/*
+ * Ask the compiler to inline a function into every caller, so that it can
+ * be specialised for constant arguments.
+ */
+#ifdef __GNUC__
+#define PV_ALWAYS_INLINE static inline __attribute__ ((always_inline))
+#else
+#define PV_ALWAYS_INLINE static
+#endif
 
 /*
  * Set the buffer size for transfers.
  */
-void pv_set_buffer_size(unsigned long long sz, int force)
+void pv_set_buffer_size(pv_state_t state, unsigned long long sz, int force)
 {
 	if ((sz > BUFFER_SIZE_MAX) && (!force))
 		sz = BUFFER_SIZE_MAX;
-	pv__bufsize = sz;
+	state->transfer.bufsize = sz;
 }
 
 
 /*
- * Transfer some data from "fd" to standard output, timing out after 9/100
- * of a second. If opts->rate_limit is >0, only up to "allowed" bytes can
- * be written. The variables that "eof_in" and "eof_out" point to are used
- * to flag that we've finished reading and writing respectively.
- *
- * Returns the number of bytes written, or negative on error (in which case
- * opts->exit_status is updated). In line mode, the number of lines written
- * will be put into *lineswritten.
- *
- * If "opts" is NULL, then the transfer buffer is freed, and zero is
- * returned.
+ * Lock the given transfer buffer into memory if the options ask for it,
+ * warning (but carrying on) if this is not possible.
  */
-long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
-		 unsigned long long allowed, long *lineswritten)
+static void pv__buffer_lock(opts_t opts, unsigned char *buf,
+			    unsigned long long sz)
 {
-	static unsigned char *buf = NULL;
-	static unsigned long long buf_alloced = 0;
-	static unsigned long in_buffer = 0;
-	static unsigned long bytes_written = 0;
-	struct timeval tv;
-	fd_set readfds;
-	fd_set writefds;
-	int max_fd;
-	long to_write, written;
-	ssize_t r, w;
-#ifdef HAVE_SPLICE
-	static int splice_failed_fd = -1;
-	int splice_used = 0;
+	if (!opts->lock_buffer)
+		return;
+#ifdef HAVE_MLOCK
+	if (mlock(buf, sz) == 0)
+		return;
+	fprintf(stderr, "%s: %s: %s\n",
+		opts->program_name,
+		_("failed to lock buffer into memory"), strerror(errno));
+#else
+	fprintf(stderr, "%s: %s\n",
+		opts->program_name,
+		_("buffer locking is not supported on this system"));
 #endif
-	int n;
+	opts->lock_buffer = 0;
+}
 
-	if (opts == NULL) {
-		if (buf)
-			free(buf);
-		buf = NULL;
-		in_buffer = 0;
-		bytes_written = 0;
+
+/*
+ * Unlock a transfer buffer previously locked with pv__buffer_lock(). This
+ * is harmless if the buffer was never locked.
+ */
+static void pv__buffer_unlock(unsigned char *buf, unsigned long long sz)
+{
+#ifdef HAVE_MLOCK
+	munlock(buf, sz);
+#endif
+}
+
+
+/*
+ * Write the current range of unreadable data, if there is one, to the
+ * error map file, and forget about it.
+ */
+static void pv__bad_flush(struct pv_transfer_state *t)
+{
+	if (t->bad_len == 0)
+		return;
+	if (t->errmap != NULL) {
+		fprintf(t->errmap, "%s\t%llu\t%llu\n", t->bad_file,
+			t->bad_start, t->bad_len);
+		fflush(t->errmap);
+	}
+	t->bad_len = 0;
+}
+
+
+/*
+ * Record that "len" bytes at offset "pos" of the current input file could
+ * not be read, merging this with the current bad range if they are
+ * contiguous. Returns nonzero if this starts a new bad range.
+ */
+static int pv__bad_add(pv_state_t state, unsigned long long pos,
+		       unsigned long long len)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+
+	t->bad_sectors++;
+	state->exit_status |= 16;
+
+	if ((t->bad_len > 0) && (t->bad_file == state->current_file)
+	    && (t->bad_start + t->bad_len == pos)) {
+		t->bad_len += len;
 		return 0;
 	}
 
-	if (buf == NULL) {
-		buf_alloced = pv__bufsize;
-		buf = (unsigned char *) malloc(pv__bufsize + 32);
-		if (buf == NULL) {
+	pv__bad_flush(t);
+	t->bad_file = state->current_file;
+	t->bad_start = pos;
+	t->bad_len = len;
+	return 1;
+}
+
+
+/*
+ * Recover from a read error on "fd", where "read_errno" was the error, by
+ * retrying the read from the same position with geometrically smaller
+ * block sizes. If even a SKIP_BLOCK_SIZE read fails, that block is filled
+ * with zeroes in "buf" and skipped over, and the next call will go back to
+ * reading "count" bytes at a time.
+ *
+ * Returns the number of bytes placed in "buf" (0 at end of file), or -1 if
+ * "fd" is not seekable, in which case errno is set to "read_errno".
+ */
+static ssize_t pv__read_recover(pv_state_t state, int fd,
+				unsigned char *buf, size_t count,
+				int read_errno)
+{
+	opts_t opts = state->opts;
+	long long pos, end;
+	size_t sz;
+	ssize_t r;
+
+	pos = lseek64(fd, 0, SEEK_CUR);
+	end = lseek64(fd, 0, SEEK_END);
+	if ((pos < 0) || (end < 0) || (lseek64(fd, pos, SEEK_SET) < 0)) {
+		errno = read_errno;
+		return -1;
+	}
+
+	for (sz = count / 2; sz >= SKIP_BLOCK_SIZE; sz /= 2) {
+		if (lseek64(fd, pos, SEEK_SET) < 0)
+			break;
+		r = read( /* RATS: ignore (checked OK) */ fd, buf, sz);
+		if (r >= 0)
+			return r;
+	}
+
+	/*
+	 * Skip to the next block boundary, but not past the end of the
+	 * file.
+	 */
+	sz = SKIP_BLOCK_SIZE - (pos % SKIP_BLOCK_SIZE);
+	if (sz > count)
+		sz = count;
+	if ((end > pos) && (pos + (long long) sz > end))
+		sz = end - pos;
+	if (end <= pos)
+		return 0;
+
+	if (lseek64(fd, pos + sz, SEEK_SET) < 0) {
+		errno = read_errno;
+		return -1;
+	}
+
+	memset(buf, 0, sz);
+
+	if (pv__bad_add(state, pos, sz)) {
+		fprintf(stderr, "%s: %s: %s: %s: %s %llu\n",
+			opts->program_name,
+			state->current_file,
+			_("read failed"), strerror(read_errno),
+			_("skipping unreadable data at offset"),
+			(unsigned long long) pos);
+	}
+
+	return sz;
+}
+
+
+/*
+ * Having just written "written" bytes to the output, start writeback of
+ * each complete window of opts->write_behind bytes, and wait for the
+ * window before it to reach the disk, so that no more than two windows of
+ * dirty data are outstanding at once. This only applies if the output is
+ * a regular file, and stops for the rest of the transfer if the system
+ * refuses to do it.
+ */
+static void pv__write_behind(pv_state_t state, long written)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+	int outfd = state->output_fd;
+	unsigned long long window;
+	struct stat64 sb;
+	long long pos;
+
+	if (t->wb_active < 0) {
+		t->wb_active = 0;
+		pos = lseek64(outfd, 0, SEEK_CUR);
+		if ((fstat64(outfd, &sb) == 0)
+		    && (S_ISREG(sb.st_mode)) && (pos >= written)) {
+			t->wb_active = 1;
+			t->wb_offset = pos - written;
+			t->wb_start = t->wb_offset;
+			t->wb_origin = t->wb_offset;
+		}
+	}
+
+	if (t->wb_active == 0)
+		return;
+
+	window = state->opts->write_behind;
+	t->wb_offset += written;
+
+	while (t->wb_offset - t->wb_start >= window) {
+#ifdef HAVE_SYNC_FILE_RANGE
+		if (sync_file_range(outfd, t->wb_start, window,
+				    SYNC_FILE_RANGE_WRITE) != 0) {
+			t->wb_active = 0;
+			return;
+		}
+		/*
+		 * Only wait on windows we wrote ourselves, not on whatever
+		 * was already in the file before the offset we started at.
+		 */
+		if ((t->wb_start >= t->wb_origin + window)
+		    && (sync_file_range(outfd,
+					t->wb_start - window, window,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER) != 0)) {
+			t->wb_active = 0;
+			return;
+		}
+#else				/* !HAVE_SYNC_FILE_RANGE */
+		if (fdatasync(outfd) != 0) {
+			t->wb_active = 0;
+			return;
+		}
+#endif				/* HAVE_SYNC_FILE_RANGE */
+		t->wb_start += window;
+	}
+}
+
+
+/*
+ * Free the transfer buffer and reset all transfer state.
+ */
+void pv_transfer_free(pv_state_t state)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+
+	if (t->buf) {
+		pv__buffer_unlock(t->buf, t->buf_alloced + 32);
+		free(t->buf);
+	}
+	t->buf = NULL;
+	t->buf_alloced = 0;
+	t->in_buffer = 0;
+	t->bytes_written = 0;
+	t->prebuffering = 0;
+	pv__bad_flush(t);
+	if (t->errmap != NULL)
+		fclose(t->errmap);
+	t->errmap = NULL;
+	t->wb_active = -1;
+}
+
+
+/*
+ * Allocate the transfer buffer if we don't have one yet, or grow it if the
+ * buffer size has changed mid-transfer. Returns nonzero on error.
+ */
+static int pv__transfer_alloc(pv_state_t state)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+	opts_t opts = state->opts;
+
+	if (t->bufsize == 0)
+		t->bufsize = BUFFER_SIZE;
+
+	if (t->buf == NULL) {
+		t->buf_alloced = t->bufsize;
+		t->buf = (unsigned char *) calloc(1, t->bufsize + 32);
+		if (t->buf == NULL) {
 			fprintf(stderr, "%s: %s: %s\n",
 				opts->program_name,
 				_("buffer allocation failed"),
 				strerror(errno));
-			opts->exit_status |= 64;
-			return -1;
+			state->exit_status |= 64;
+			return 1;
+		}
+		pv__buffer_lock(opts, t->buf, t->buf_alloced + 32);
+
+		if ((opts->skip_errors) && (opts->error_map != NULL)) {
+			t->errmap = fopen(opts->error_map, "w");
+			if (t->errmap == NULL) {
+				fprintf(stderr, "%s: %s: %s\n",
+					opts->program_name,
+					opts->error_map, strerror(errno));
+				state->exit_status |= 2;
+			}
 		}
 	}
 
 	/*
 	 * Reallocate the buffer if the buffer size has changed mid-transfer.
 	 */
-	if (buf_alloced < pv__bufsize) {
+	if (t->buf_alloced < t->bufsize) {
 		unsigned char *newptr;
+		if (opts->lock_buffer)
+			pv__buffer_unlock(t->buf, t->buf_alloced + 32);
 		newptr =
-		    realloc( /* RATS: ignore */ buf, pv__bufsize + 32);
+		    realloc( /* RATS: ignore */ t->buf, t->bufsize + 32);
 		if (newptr == NULL) {
-			pv__bufsize = buf_alloced;
+			t->bufsize = t->buf_alloced;
 		} else {
-			buf = newptr;
-			buf_alloced = pv__bufsize;
+			t->buf = newptr;
+			t->buf_alloced = t->bufsize;
 		}
+		pv__buffer_lock(opts, t->buf, t->buf_alloced + 32);
 	}
 
-	if ((opts->linemode) && (lineswritten != NULL))
+	return 0;
+}
+
+
+/*
+ * Transfer some data from "fd" to the output, timing out after 9/100 of a
+ * second (or straight away if t->nowait is set). If "limited" is nonzero,
+ * only up to "allowed" bytes can be written. The variables that "eof_in"
+ * and "eof_out" point to are used to flag that we've finished reading and
+ * writing respectively.
+ *
+ * Returns the number of bytes written, or negative on error (in which case
+ * state->exit_status is updated). If "linemode" is nonzero, the number of
+ * lines written will be put into *lineswritten.
+ *
+ * The "linemode" and "limited" parameters are always constants, so that
+ * each of the pv__transfer_*() variants below gets its own copy of this
+ * function with the tests on them, and the code they guard, optimised out
+ * where they can't apply.
+ *
+ * If opts->high_water is nonzero, nothing is written until the buffer is
+ * at least that percentage full (or input has ended), and writing then
+ * continues until the buffer drains to opts->low_water percent, at which
+ * point we go back to filling it.
+ *
+ * If opts->skip_errors is set, read errors on seekable inputs are
+ * recovered from with pv__read_recover() instead of ending the input.
+ *
+ * If opts->write_behind is nonzero, pv__write_behind() is used to limit
+ * the amount of unwritten data the kernel is holding for standard output.
+ */
+PV_ALWAYS_INLINE long pv__transfer(pv_state_t state, int fd, int *eof_in,
+				   int *eof_out, unsigned long long allowed,
+				   long *lineswritten, const int linemode,
+				   const int limited)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+	opts_t opts = state->opts;
+	int outfd = state->output_fd;
+	struct timeval tv;
+	fd_set readfds;
+	fd_set writefds;
+	int max_fd;
+	long to_write, written;
+	ssize_t r, w;
+#ifdef HAVE_SPLICE
+	int splice_used = 0;
+	size_t splice_len;
+#endif
+#ifdef MAXIMISE_BUFFER_FILL
+	int rotate;
+#endif
+	int n;
+
+	if (pv__transfer_alloc(state))
+		return -1;
+
+	if ((linemode) && (lineswritten != NULL))
 		*lineswritten = 0;
 
 	tv.tv_sec = 0;
-	tv.tv_usec = 90000;
+	tv.tv_usec = t->nowait ? 0 : 90000;
 
 	FD_ZERO(&readfds);
 	FD_ZERO(&writefds);
 
 	max_fd = 0;
 
-	if ((!(*eof_in)) && (in_buffer < pv__bufsize)) {
+	if ((!(*eof_in)) && (t->in_buffer < t->bufsize)) {
 		FD_SET(fd, &readfds);
 		if (fd > max_fd)
 			max_fd = fd;
 	}
 
-	to_write = in_buffer - bytes_written;
-	if (opts->rate_limit > 0) {
-		if (to_write > allowed) {
+	to_write = t->in_buffer - t->bytes_written;
+
+	/*
+	 * With watermarks, switch between filling and draining the buffer
+	 * as the amount in it crosses the high and low water marks; in
+	 * between the two, carry on doing whatever we were doing before.
+	 */
+	if (opts->high_water > 0) {
+		if (*eof_in) {
+			t->prebuffering = 0;
+		} else if (to_write >=
+			   (long) ((t->bufsize * opts->high_water) / 100)) {
+			t->prebuffering = 0;
+		} else if (to_write <=
+			   (long) ((t->bufsize * opts->low_water) / 100)) {
+			t->prebuffering = 1;
+		}
+		if (t->prebuffering)
+			to_write = 0;
+	}
+
+	if (limited) {
+		if ((unsigned long long) to_write > allowed) {
 			to_write = allowed;
 		}
 	}
 
 	if ((!(*eof_out)) && (to_write > 0)) {
-		FD_SET(STDOUT_FILENO, &writefds);
-		if (STDOUT_FILENO > max_fd)
-			max_fd = STDOUT_FILENO;
+		FD_SET(outfd, &writefds);
+		if (outfd > max_fd)
+			max_fd = outfd;
 	}
 
 	if ((*eof_in) && (*eof_out))
@@ -152,9 +462,9 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 		if (errno == EINTR)
 			return 0;
 		fprintf(stderr, "%s: %s: %s: %d: %s\n",
-			opts->program_name, opts->current_file,
+			opts->program_name, state->current_file,
 			_("select call failed"), n, strerror(errno));
-		opts->exit_status |= 16;
+		state->exit_status |= 16;
 		return -1;
 	}
 
@@ -162,13 +472,22 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 
 	if (FD_ISSET(fd, &readfds)) {
 #ifdef HAVE_SPLICE
+		/*
+		 * Only splice while the buffer is empty, otherwise the
+		 * spliced data would overtake what is already buffered. If
+		 * the output is not ready, splice() fails with EAGAIN and we
+		 * fall back to reading into the buffer.
+		 */
 		splice_used = 0;
-		if ((!opts->linemode) && (fd != splice_failed_fd)) {
-			r = splice(fd, NULL, STDOUT_FILENO, NULL, allowed,
-				   SPLICE_F_MORE);
+		splice_len = limited ? allowed : t->bufsize;
+		if ((!linemode) && (opts->high_water == 0)
+		    && (t->in_buffer == 0)
+		    && (fd != t->splice_failed_fd)) {
+			r = splice(fd, NULL, outfd, NULL, splice_len,
+				   SPLICE_F_MORE | SPLICE_F_NONBLOCK);
 			splice_used = 1;
 			if ((r < 0) && (errno == EINVAL)) {
-				splice_failed_fd = fd;
+				t->splice_failed_fd = fd;
 				splice_used = 0;
 			} else if (r > 0) {
 				written = r;
@@ -179,11 +498,13 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 		}
 		if (splice_used == 0) {
 			r = read( /* RATS: ignore (checked OK) */ fd,
-				 buf + in_buffer, pv__bufsize - in_buffer);
+				 t->buf + t->in_buffer,
+				 t->bufsize - t->in_buffer);
 		}
 #else
 		r = read( /* RATS: ignore (checked OK) */ fd,
-			 buf + in_buffer, pv__bufsize - in_buffer);
+			 t->buf + t->in_buffer,
+			 t->bufsize - t->in_buffer);
 #endif				/* HAVE_SPLICE */
 		if (r < 0) {
 			/*
@@ -197,52 +518,64 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 				select(0, NULL, NULL, NULL, &tv);
 				return 0;
 			}
+			if (opts->skip_errors) {
+				r = pv__read_recover(state, fd,
+						     t->buf + t->in_buffer,
+						     t->bufsize -
+						     t->in_buffer, errno);
+			}
+		}
+
+		if (r < 0) {
 			fprintf(stderr, "%s: %s: %s: %s\n",
 				opts->program_name,
-				opts->current_file,
+				state->current_file,
 				_("read failed"), strerror(errno));
-			opts->exit_status |= 16;
+			state->exit_status |= 16;
 			*eof_in = 1;
-			if (bytes_written >= in_buffer)
+			if (t->bytes_written >= t->in_buffer)
 				*eof_out = 1;
 		} else if (r == 0) {
 			*eof_in = 1;
-			if (bytes_written >= in_buffer)
+			if (t->bytes_written >= t->in_buffer)
 				*eof_out = 1;
 		} else {
 #ifdef HAVE_SPLICE
 			if (splice_used == 0)
-				in_buffer += r;
+				t->in_buffer += r;
 #else
-			in_buffer += r;
+			t->in_buffer += r;
 #endif				/* HAVE_SPLICE */
 
 		}
 	}
 
-	/*
-	 * In line mode, only write up to and including the first newline,
-	 * so that we're writing output line-by-line.
-	 */
-	if (opts->linemode) {
-		int ckidx;
-		for (ckidx = 1; ckidx < to_write; ckidx++) {
-			if (buf[bytes_written + ckidx - 1] == '\n')
-				to_write = ckidx;
-		}
-	}
-
-	if (FD_ISSET(STDOUT_FILENO, &writefds)
+	if (FD_ISSET(outfd, &writefds)
 #ifdef HAVE_SPLICE
 	    && (splice_used == 0)
 #endif				/* HAVE_SPLICE */
-	    && (in_buffer > bytes_written)
+	    && (t->in_buffer > t->bytes_written)
 	    && (to_write > 0)) {
 
+		/*
+		 * In line mode, write all the complete lines we have in one
+		 * go, holding back any partial line at the end until the
+		 * rest of it arrives. Only the partial line is scanned here,
+		 * since we search backwards from the end; if there are no
+		 * complete lines at all, we write what we have as before.
+		 */
+		if ((linemode) && (to_write > 1)) {
+			unsigned char *nl;
+			nl = pv_memrchr(t->buf + t->bytes_written,
+					opts->delimiter, to_write);
+			if (nl != NULL)
+				to_write = 1 + nl - (t->buf + t->bytes_written);
+		}
+
 		signal(SIGALRM, SIG_IGN);   /* RATS: ignore */
 		alarm(1);
 
-		w = write(STDOUT_FILENO, buf + bytes_written, to_write);
+		w = write(outfd, t->buf + t->bytes_written, to_write);
 
 		alarm(0);
 
@@ -270,27 +603,22 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 			fprintf(stderr, "%s: %s: %s\n",
 				opts->program_name,
 				_("write failed"), strerror(errno));
-			opts->exit_status |= 16;
+			state->exit_status |= 16;
 			*eof_out = 1;
 			written = -1;
 		} else if (w == 0) {
 			*eof_out = 1;
 		} else {
-			if ((opts->linemode) && (lineswritten != NULL)) {
-				int nlidx;
-				for (nlidx = 0; nlidx < w; nlidx++) {
-					if (buf[bytes_written + nlidx] ==
-					    '\n') {
-						*lineswritten =
-						    1 + (*lineswritten);
-					}
-				}
+			if ((linemode) && (lineswritten != NULL)) {
+				*lineswritten +=
+				    pv_memcount(t->buf + t->bytes_written, w,
+						opts->delimiter);
 			}
-			bytes_written += w;
+			t->bytes_written += w;
 			written += w;
-			if (bytes_written >= in_buffer) {
-				bytes_written = 0;
-				in_buffer = 0;
+			if (t->bytes_written >= t->in_buffer) {
+				t->bytes_written = 0;
+				t->in_buffer = 0;
 				if (*eof_in)
 					*eof_out = 1;
 			}
@@ -300,20 +628,122 @@ long pv_transfer(opts_t opts, int fd, int *eof_in, int *eof_out,
 	/*
 	 * Rotate the written bytes out of the buffer so that it can be
 	 * filled up completely by the next read.
+	 *
+	 * With watermarks the buffer is typically large and mostly full, so
+	 * we only rotate once at least as much has been written as would
+	 * need to be moved, or the end of the buffer has been reached, to
+	 * avoid moving most of the buffer on every write.
 	 */
-	if (bytes_written > 0) {
-		if (bytes_written < in_buffer) {
-			memmove(buf, buf + bytes_written,
-				in_buffer - bytes_written);
-			in_buffer -= bytes_written;
-			bytes_written = 0;
+	rotate = 1;
+	if ((opts->high_water > 0) && (t->in_buffer < t->bufsize)
+	    && (t->bytes_written < t->in_buffer - t->bytes_written))
+		rotate = 0;
+	if ((rotate) && (t->bytes_written > 0)) {
+		if (t->bytes_written < t->in_buffer) {
+			memmove(t->buf, t->buf + t->bytes_written,
+				t->in_buffer - t->bytes_written);
+			t->in_buffer -= t->bytes_written;
+			t->bytes_written = 0;
 		} else {
-			bytes_written = 0;
-			in_buffer = 0;
+			t->bytes_written = 0;
+			t->in_buffer = 0;
 		}
 	}
 #endif				/* MAXIMISE_BUFFER_FILL */
+
+	if ((written > 0) && (opts->write_behind > 0))
+		pv__write_behind(state, written);
+
 	return written;
 }
 
+
+/*
+ * Generate a variant of pv__transfer() for one combination of line mode
+ * and rate limiting.
+ */
+#define PV_TRANSFER_VARIANT(name, linemode, limited) \
+static long name(pv_state_t state, int fd, int *eof_in, int *eof_out, \
+		 unsigned long long allowed, long *lineswritten) \
+{ \
+	return pv__transfer(state, fd, eof_in, eof_out, allowed, \
+			    lineswritten, linemode, limited); \
+}
+
+PV_TRANSFER_VARIANT(pv__transfer_bytes, 0, 0)
+PV_TRANSFER_VARIANT(pv__transfer_bytes_limited, 0, 1)
+PV_TRANSFER_VARIANT(pv__transfer_lines, 1, 0)
+PV_TRANSFER_VARIANT(pv__transfer_lines_limited, 1, 1)
+
+
+/*
+ * Return the variant of the transfer function to use for the given state's
+ * options. This must be called again if opts->linemode or whether the
+ * main loop is rate limiting the transfer (state->loop.limited) changes.
+ */
+pv_transfer_fn pv_transfer_select(pv_state_t state)
+{
+	int limited = state->loop.limited;
+
+	if (state->opts->linemode) {
+		if (limited)
+			return pv__transfer_lines_limited;
+		return pv__transfer_lines;
+	}
+	if (limited)
+		return pv__transfer_bytes_limited;
+	return pv__transfer_bytes;
+}
+
+
+/*
+ * Return the number of bytes at the start of the data waiting in the
+ * buffer to be written that make up at most "records" complete records,
+ * i.e. lines ending in opts->delimiter, so that a line rate limit never
+ * causes a record to be split. A partial record at the end is included
+ * if "eof_in" is nonzero, since the rest of it is never going to arrive.
+ */
+unsigned long long pv_transfer_records(pv_state_t state,
+				       unsigned long long records, int eof_in)
+{
+	struct pv_transfer_state *t = &(state->transfer);
+	unsigned char delimiter = state->opts->delimiter;
+	unsigned char *start;
+	unsigned char *end;
+	unsigned char *ptr;
+
+	if ((records < 1) || (t->buf == NULL)
+	    || (t->in_buffer <= t->bytes_written))
+		return 0;
+
+	start = t->buf + t->bytes_written;
+	end = t->buf + t->in_buffer;
+
+	if (pv_memcount(start, end - start, delimiter) < records) {
+		if (eof_in)
+			return end - start;
+		ptr = pv_memrchr(start, delimiter, end - start);
+		return (ptr == NULL) ? 0 : 1 + ptr - start;
+	}
+
+	for (ptr = start; records > 0; records--)
+		ptr = 1 + (unsigned char *) memchr(ptr, delimiter, end - ptr);
+
+	return ptr - start;
+}
+
+
+/*
+ * Transfer some data from "fd" to standard output, as described in
+ * pv__transfer() above, using the appropriate variant for the given
+ * state's options. Callers doing this repeatedly should use
+ * pv_transfer_select() instead.
+ */
+long pv_transfer(pv_state_t state, int fd, int *eof_in, int *eof_out,
+		 unsigned long long allowed, long *lineswritten)
+{
+	return (pv_transfer_select(state)) (state, fd, eof_in, eof_out,
+					    allowed, lineswritten);
+}
+
 /* EOF */